@@ -1,13 +1,49 @@
 
 #include "fs.h"
 
+// The block cache holds at most BCBLOCKS blocks besides the superblock
+// and the bitmap, which are never evicted.  The others are kept on a
+// CLOCK ring: the hand skips (and clears) blocks whose PTE_A is set,
+// and evicts the first block not accessed since its last visit.
+#define BCBLOCKS	1024
+
+// Most blocks one disk command can move (256 sectors)
+#define BC_MAXRUN	(256 / BLKSECTS)
+
+static uint32_t bc_ring[BCBLOCKS];	// block numbers, 0 if free
+static int bc_hand;
+
+// bc_prefetch reads blocks in the background: each run of them is read
+// into pages at FETCHMAP, and only once the disk is done does bc_reap()
+// map them into place, so no one sees a block half read.  A fault on a
+// block being read waits for that read instead of starting another.
+#define BC_NFETCH	8
+#define FETCHMAP	0xDC000000
+
+struct BcFetch {
+	struct IoReq f_req;
+	uint32_t f_blockno;		// first block, 0 if the slot is free
+	uint32_t f_nblocks;
+};
+
+static struct BcFetch bc_fetch[BC_NFETCH];
+#define FETCHVA(f)	((char*) FETCHMAP + ((f) - bc_fetch) * BC_MAXRUN * BLKSIZE)
+
+struct BcStats bc_stats;
+
 // Return the virtual address of this disk block.
 void*
 diskaddr(uint32_t blockno)
 {
-	if (blockno == 0 || (super && blockno >= super->s_nblocks))
+	void *va;
+
+	if (blockno == 0
+	    || (super && blockno >= super->s_nblocks && !tmpfs_block(blockno)))
 		panic("bad block number %08x in diskaddr", blockno);
-	return (char*) (DISKMAP + blockno * BLKSIZE);
+	va = (char*) (DISKMAP + blockno * BLKSIZE);
+	if (va_is_mapped(va))
+		bc_stats.bc_hits++;
+	return va;
 }
 
 // Is this virtual address mapped?
@@ -24,6 +60,124 @@ va_is_dirty(void *va)
 	return (uvpt[PGNUM(va)] & PTE_D) != 0;
 }
 
+// Blocks that must stay in the cache: the superblock and the bitmap
+// are used through plain pointers (super, bitmap).
+static bool
+bc_pinned(uint32_t blockno)
+{
+	return blockno < 2 || super == NULL
+		|| blockno < 2 + (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
+}
+
+// Clear PTE_A on the block at 'va'.  Remapping clears PTE_D as well,
+// so a dirty block keeps its PTE_A instead: writing it out here would
+// defeat delayed write-back and the journal's ordering.  The
+// write-back pass cleans it, or eviction once no clean block is left.
+static void
+bc_clear_accessed(void *va)
+{
+	int r;
+
+	if (!va_is_dirty(va)
+	    && (r = sys_page_map(0, va, 0, va, uvpt[PGNUM(va)] & PTE_SYSCALL)) < 0)
+		panic("in bc_clear_accessed, sys_page_map: %e", r);
+}
+
+// Make room for block 'blockno' in the cache, evicting a block if the
+// cache is full.  Blocks that clients map shared (serve_map's
+// MAP_SHARED pages) stay: evicting one would leave the client with
+// a frame the server no longer writes.  Copy-on-write ones may go:
+// cache pages are mapped PTE_P|PTE_U|PTE_W, so only share_block's
+// carry PTE_COW.  On its second time around the ring the hand takes
+// dirty blocks too, whose PTE_A it leaves set.
+static void
+bc_make_room(uint32_t blockno)
+{
+	void *va;
+	int n, r;
+
+	if (bc_pinned(blockno))
+		return;
+
+	for (n = 0; ; n++) {
+		if (n == 2 * BCBLOCKS)
+			// all of them mapped by clients: the new block goes
+			// unlisted, never to be evicted
+			return;
+		va = (char*) (DISKMAP + bc_ring[bc_hand] * BLKSIZE);
+		if (bc_ring[bc_hand] == 0 || !va_is_mapped(va))
+			break;	// free, or unmapped behind our back
+		if (pageref(va) > 1 && !(uvpt[PGNUM(va)] & PTE_COW)) {
+			bc_hand = (bc_hand + 1) % BCBLOCKS;
+			continue;
+		}
+		if (!(uvpt[PGNUM(va)] & PTE_A) || n >= BCBLOCKS) {
+			flush_block(va);
+			if ((r = sys_page_unmap(0, va)) < 0)
+				panic("in bc_make_room, sys_page_unmap: %e", r);
+			bc_stats.bc_evictions++;
+			break;
+		}
+		bc_clear_accessed(va);
+		bc_hand = (bc_hand + 1) % BCBLOCKS;
+	}
+	bc_ring[bc_hand] = blockno;
+	bc_hand = (bc_hand + 1) % BCBLOCKS;
+}
+
+// Return the background read that has block 'blockno', if any.
+static struct BcFetch *
+bc_fetching(uint32_t blockno)
+{
+	struct BcFetch *f;
+
+	for (f = bc_fetch; f < bc_fetch + BC_NFETCH; f++)
+		if (f->f_blockno && blockno >= f->f_blockno
+		    && blockno < f->f_blockno + f->f_nblocks)
+			return f;
+	return NULL;
+}
+
+// Map the blocks of the finished read f into the cache, and free f.
+static void
+bc_install(struct BcFetch *f)
+{
+	uint32_t i, blockno = f->f_blockno;
+	char *src = FETCHVA(f), *va;
+	int r;
+
+	f->f_blockno = 0;
+	for (i = 0; i < f->f_nblocks; i++, src += BLKSIZE) {
+		va = (char*) (DISKMAP + (blockno + i) * BLKSIZE);
+		if (!va_is_mapped(va)) {
+			bc_make_room(blockno + i);
+			// a fresh mapping, so clean
+			if ((r = sys_page_map(0, src, 0, va, PTE_P|PTE_U|PTE_W)) < 0)
+				panic("in bc_install, sys_page_map: %e", r);
+			// mark it accessed, so mapping the rest of the run
+			// can't evict it
+			(void) *(volatile char*) va;
+		}
+		sys_page_unmap(0, src);
+	}
+}
+
+// Put every finished background read in the cache.  Returns how many
+// there were.
+int
+bc_reap(void)
+{
+	struct BcFetch *f;
+	int n = 0;
+
+	for (f = bc_fetch; f < bc_fetch + BC_NFETCH; f++)
+		if (f->f_blockno && f->f_req.done) {
+			bc_install(f);
+			n++;
+		}
+	return n;
+}
+
 // Fault any disk block that is read in to memory by
 // loading it from disk.
 static void
@@ -31,17 +185,47 @@ bc_pgfault(struct UTrapframe *utf)
 {
 	void *addr = (void *) utf->utf_fault_va;
 	uint32_t blockno = ((uint32_t)addr - DISKMAP) / BLKSIZE;
+	struct BcFetch *f;
 	int r;
 
+	// Forking the write-back timer left our own pages copy-on-write.
+	if ((utf->utf_err & FEC_WR) && (uvpd[PDX(addr)] & PTE_P)
+	    && (uvpt[PGNUM(addr)] & PTE_COW)
+	    && (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))) {
+		addr = ROUNDDOWN(addr, PGSIZE);
+		if ((r = sys_page_alloc(0, PFTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("in bc_pgfault, sys_page_alloc: %e", r);
+		memmove(PFTEMP, addr, PGSIZE);
+		if ((r = sys_page_map(0, PFTEMP, 0, addr, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("in bc_pgfault, sys_page_map: %e", r);
+		sys_page_unmap(0, PFTEMP);
+		return;
+	}
+
 	// Check that the fault was within the block cache region
 	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
 		panic("page fault in FS: eip %08x, va %08x, err %04x",
 		      utf->utf_eip, addr, utf->utf_err);
 
 	// Sanity check the block number.
-	if (super && blockno >= super->s_nblocks)
+	if (super && blockno >= super->s_nblocks && !tmpfs_block(blockno))
 		panic("reading non-existent block %08x\n", blockno);
 
+	// A write to a block shared with clients (see serve_read_map)
+	// gets a private copy.  Only that can fault on a mapped block.
+	// The shared mapping is read-only, so even once no client holds
+	// it any more it can't simply be made writable again.
+	if ((utf->utf_err & FEC_WR) && va_is_mapped(addr)) {
+		addr = ROUNDDOWN(addr, BLKSIZE);
+		if ((r = sys_page_alloc(0, PFTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("in bc_pgfault, sys_page_alloc: %e", r);
+		memmove(PFTEMP, addr, BLKSIZE);
+		if ((r = sys_page_map(0, PFTEMP, 0, addr, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("in bc_pgfault, sys_page_map: %e", r);
+		sys_page_unmap(0, PFTEMP);
+		return;
+	}
+
 	// Allocate a page in the disk map region, read the contents
 	// of the block from the disk into that page.
 	// Hint: first round addr to page boundary. fs/ide.c has code to read
@@ -49,9 +233,16 @@ bc_pgfault(struct UTrapframe *utf)
 	//
 	// LAB 5: you code here:
 	addr = ROUNDDOWN(addr, BLKSIZE);
-	if ((r = sys_page_alloc(0, addr, PTE_SYSCALL)) < 0)
+	bc_stats.bc_misses++;
+	if ((f = bc_fetching(blockno)) != NULL) {
+		ios_wait(&f->f_req);
+		bc_install(f);
+		return;
+	}
+	bc_make_room(blockno);
+	if ((r = sys_page_alloc(0, addr, PTE_P|PTE_U|PTE_W)) < 0)
 		panic("in bc_pgfault, sys_page_alloc: %e", r);
-	ide_read(blockno * BLKSIZE / SECTSIZE, addr, BLKSIZE / SECTSIZE);
+	ios_rw(blockno, addr, 1, 0);
 
 	// Clear the dirty bit for the disk block page since we just read the
 	// block from disk
@@ -65,6 +256,61 @@ bc_pgfault(struct UTrapframe *utf)
 		panic("reading free block %08x\n", blockno);
 }
 
+// Start reading the uncached blocks among [blockno, blockno + nblocks)
+// into the cache in the background, with one disk command per run of
+// them.  Returns how many of the blocks are not in the cache yet.
+int
+bc_prefetch(uint32_t blockno, uint32_t nblocks)
+{
+	uint32_t i, start;
+	struct BcFetch *f;
+	char *va;
+	int r, missing = 0;
+
+	if (super && blockno < super->s_nblocks
+	    && blockno + nblocks > super->s_nblocks)
+		nblocks = super->s_nblocks - blockno;
+
+	for (i = 0; i < nblocks; ) {
+		va = (char*) (DISKMAP + (blockno + i) * BLKSIZE);
+		if (va_is_mapped(va) || bc_fetching(blockno + i)) {
+			missing += !va_is_mapped(va);
+			i++;
+			continue;
+		}
+
+		for (f = bc_fetch; f < bc_fetch + BC_NFETCH && f->f_blockno; f++)
+			;
+		if (f == bc_fetch + BC_NFETCH)
+			// all busy; the rest will have to wait
+			return missing + nblocks - i;
+
+		for (start = i; i < nblocks && i - start < BC_MAXRUN; i++) {
+			va = (char*) (DISKMAP + (blockno + i) * BLKSIZE);
+			if (va_is_mapped(va) || bc_fetching(blockno + i))
+				break;
+			if ((r = sys_page_alloc(0, FETCHVA(f) + (i - start) * BLKSIZE,
+						PTE_P|PTE_U|PTE_W)) < 0)
+				panic("in bc_prefetch, sys_page_alloc: %e", r);
+		}
+
+		f->f_blockno = blockno + start;
+		f->f_nblocks = i - start;
+		f->f_req.blockno = blockno + start;
+		f->f_req.nblocks = i - start;
+		f->f_req.va = FETCHVA(f);
+		f->f_req.flags = 0;
+		ios_submit(&f->f_req);
+		bc_stats.bc_prefetched += i - start;
+		if (f->f_req.done)
+			// the RAM disk is done at once
+			bc_install(f);
+		else
+			missing += i - start;
+	}
+	return missing;
+}
+
 // Flush the contents of the block containing VA out to disk if
 // necessary, then clear the PTE_D bit using sys_page_map.
 // If the block is not in the block cache or is not dirty, does
@@ -79,18 +325,133 @@ flush_block(void *addr)
 
 	if (addr < (void*)DISKMAP || addr >= (void*)(DISKMAP + DISKSIZE))
 		panic("flush_block of bad va %08x", addr);
+	// metadata goes to the journal before it goes home
+	if (journal_holds(blockno, 1))
+		journal_commit();
 
 	// LAB 5: Your code here.
 	if (va_is_mapped(addr) && va_is_dirty(addr))
 	{
 		addr = ROUNDDOWN(addr, BLKSIZE);
-		ide_write(blockno * BLKSIZE / SECTSIZE, addr, BLKSIZE / SECTSIZE);
+		ios_rw(blockno, addr, 1, IOR_WRITE);
+		bc_stats.bc_writes++;
+		bc_stats.bc_written++;
 		int r;
 		if ((r = sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)] & PTE_SYSCALL)) < 0)
 		    panic("in flush_block, sys_page_map: %e", r);
 	}
 }
 
+// Note that the metadata block containing addr was just changed.
+// On a journaled disk it joins the running transaction.  Otherwise
+// it is flushed, unless delayed write-back is on, in which case the
+// next write-back pass (or an FSREQ_SYNC or FSREQ_FLUSH) writes it
+// out together with the rest.
+void
+flush_meta(void *addr)
+{
+	// a tmpfs is never written back (see tmpfs.c)
+	if (tmpfs_block(((uint32_t) addr - DISKMAP) / BLKSIZE))
+		return;
+	if (journal_enabled())
+		journal_add(addr);
+	else if (WB_MAXAGE == 0)
+		flush_block(addr);
+}
+
+// flush_blocks queues its runs of dirty blocks all at once, as
+// background write-back, so that the I/O scheduler can order them and
+// let reads go first.
+#define BC_NWB		64
+static struct IoReq bc_wb[BC_NWB];
+
+// Wait for the first n write-back requests, and clear their blocks'
+// PTE_D.
+static void
+bc_wb_finish(int n)
+{
+	uint32_t i;
+	char *va;
+	int r;
+
+	for (; n > 0; n--) {
+		ios_wait(&bc_wb[n - 1]);
+		va = bc_wb[n - 1].va;
+		for (i = 0; i < bc_wb[n - 1].nblocks; i++, va += BLKSIZE)
+			if ((r = sys_page_map(0, va, 0, va, uvpt[PGNUM(va)] & PTE_SYSCALL)) < 0)
+				panic("in flush_blocks, sys_page_map: %e", r);
+	}
+}
+
+// Write out the dirty blocks among [blockno, blockno + nblocks), with
+// one request per run of consecutive dirty blocks, and clear their
+// PTE_D.
+void
+flush_blocks(uint32_t blockno, uint32_t nblocks)
+{
+	uint32_t i, start;
+	struct IoReq *wb;
+	int n = 0;
+	char *va;
+
+	if (journal_holds(blockno, nblocks))
+		journal_commit();
+	for (i = 0; i < nblocks; ) {
+		for (start = i; i < nblocks && i - start < BC_MAXRUN; i++) {
+			va = (char*) (DISKMAP + (blockno + i) * BLKSIZE);
+			if (!va_is_mapped(va) || !va_is_dirty(va))
+				break;
+		}
+		if (i == start) {
+			i++;
+			continue;
+		}
+
+		if (n == BC_NWB) {
+			bc_wb_finish(n);
+			n = 0;
+		}
+		wb = &bc_wb[n++];
+		wb->blockno = blockno + start;
+		wb->nblocks = i - start;
+		wb->va = (char*) (DISKMAP + (blockno + start) * BLKSIZE);
+		wb->flags = IOR_WRITE | IOR_BACKGROUND;
+		ios_submit(wb);
+		bc_stats.bc_writes++;
+		bc_stats.bc_written += i - start;
+	}
+	bc_wb_finish(n);
+}
+
+// Write out every dirty block in the cache.  The page tables of the
+// DISKMAP region are the dirty set: it's walked in block order, one
+// page table at a time, skipping page tables that aren't there.
+void
+bc_sync(void)
+{
+	uint32_t blockno, nblocks = super->s_nblocks;
+
+	for (blockno = 0; blockno < nblocks; blockno += NPTENTRIES) {
+		if (!(uvpd[PDX(DISKMAP + blockno * BLKSIZE)] & PTE_P))
+			continue;
+		flush_blocks(blockno, MIN(NPTENTRIES, nblocks - blockno));
+	}
+}
+
+// Share the clean block at 'addr' copy-on-write: write it out if
+// dirty, then map it read-only so that the next write to it from
+// the file system gets a fresh page (see bc_pgfault).
+void
+share_block(void *addr)
+{
+	int r;
+
+	addr = ROUNDDOWN(addr, BLKSIZE);
+	flush_block(addr);
+	if ((r = sys_page_map(0, addr, 0, addr, PTE_P|PTE_U|PTE_COW)) < 0)
+		panic("in share_block, sys_page_map: %e", r);
+}
+
 // Test that the block cache works, by smashing the superblock and
 // reading it back.
 static void
@@ -1,3 +1,4 @@
+#include <inc/x86.h>
 #include <inc/string.h>
 #include <inc/partition.h>
 
@@ -24,11 +25,20 @@ check_super(void)
 // Free block bitmap
 // --------------------------------------------------------------
 
+#define BITMAP_WORDS	(BLKBITSIZE / 32)	// bitmap words per bitmap block
+
+// Free blocks left in each bitmap block, so full ones can be skipped.
+static uint32_t bitmap_nfree[DISKSIZE / BLKSIZE / BLKBITSIZE];
+// Next-fit: where the search for a block with no goal starts.
+static uint32_t alloc_cursor;
+
 // Check to see if the block bitmap indicates that block 'blockno' is free.
 // Return 1 if the block is free, 0 if not.
 bool
 block_is_free(uint32_t blockno)
 {
+	if (tmpfs_block(blockno))
+		return tmpfs_is_free(blockno);
 	if (super == 0 || blockno >= super->s_nblocks)
 		return 0;
 	if (bitmap[blockno / 32] & (1 << (blockno % 32)))
@@ -43,12 +53,104 @@ free_block(uint32_t blockno)
 	// Blockno zero is the null pointer of block numbers.
 	if (blockno == 0)
 		panic("attempt to free zero block");
+	if (tmpfs_block(blockno)) {
+		tmpfs_free(blockno);
+		return;
+	}
+	if (!block_is_free(blockno))
+		bitmap_nfree[blockno / BLKBITSIZE]++;
 	bitmap[blockno/32] |= 1<<(blockno%32);
+	flush_meta(&bitmap[blockno/32]);
+}
+
+// The free bits of bitmap word w, without those past the end of the disk.
+static uint32_t
+bitmap_word(uint32_t w)
+{
+	uint32_t bits = bitmap[w];
+
+	if ((w + 1) * 32 > super->s_nblocks)
+		bits &= (1 << (super->s_nblocks % 32)) - 1;
+	return bits;
+}
+
+// Count the free blocks under each bitmap block.
+static void
+bitmap_count(void)
+{
+	uint32_t w, bits;
+
+	memset(bitmap_nfree, 0, sizeof(bitmap_nfree));
+	for (w = 0; w * 32 < super->s_nblocks; w++)
+		for (bits = bitmap_word(w); bits; bits &= bits - 1)
+			bitmap_nfree[w / BITMAP_WORDS]++;
+}
+
+// Find a free block at or after 'start', wrapping around at the end of
+// the disk, a bitmap word at a time.  With 'run' set only wholly free
+// words count, so the block found starts 32 free ones.
+// Returns the block number, or 0 if there is none.
+static uint32_t
+bitmap_search(uint32_t start, bool run)
+{
+	uint32_t nwords = (super->s_nblocks + 31) / 32;
+	uint32_t w, n, bits, skip;
+
+	if (start >= super->s_nblocks)
+		start = 0;
+	w = start / 32;
+	for (n = 0; n <= nwords; n++, w++) {
+		if (w == nwords)
+			w = 0;
+		if (bitmap_nfree[w / BITMAP_WORDS] == 0) {
+			skip = MIN(BITMAP_WORDS - 1 - w % BITMAP_WORDS, nwords - 1 - w);
+			n += skip;
+			w += skip;
+			continue;
+		}
+		bits = bitmap_word(w);
+		if (n == 0)
+			bits &= ~0U << (start % 32);
+		if (run ? bits == ~0U : bits != 0)
+			return w * 32 + bsf(bits);
+	}
+	return 0;
+}
+
+// Mark the free block 'blockno' in use.
+static void
+take_block(uint32_t blockno)
+{
+	if (tmpfs_block(blockno)) {
+		tmpfs_take(blockno);
+		return;
+	}
+	bitmap[blockno / 32] &= ~(1 << (blockno % 32));
+	bitmap_nfree[blockno / BLKBITSIZE]--;
+	alloc_cursor = blockno + 1;
+}
+
+// Pick a free block: 'goal' if it is free, otherwise one starting
+// a wholly free bitmap word after it, so a file has room to grow,
+// otherwise any.  Goal 0 means no preference (next fit).
+// Returns 0 if the disk is full.
+static uint32_t
+find_block(uint32_t goal)
+{
+	uint32_t blockno;
+
+	if (tmpfs_near(goal))
+		return tmpfs_find(goal);
+	if (goal && block_is_free(goal))
+		return goal;
+	if (goal && (blockno = bitmap_search(goal, 1)) != 0)
+		return blockno;
+	return bitmap_search(goal ? goal : alloc_cursor, 0);
 }
 
 // Search the bitmap for a free block and allocate it.  When you
-// allocate a block, immediately flush the changed bitmap block
-// to disk.
+// allocate a block, flush the changed bitmap block to disk
+// (or leave it to the write-back pass, see flush_meta).
 //
 // Return block number allocated on success,
 // -E_NO_DISK if we are out of blocks.
@@ -57,26 +159,43 @@ free_block(uint32_t blockno)
 int
 alloc_block(void)
 {
-	// The bitmap consists of one or more blocks.  A single bitmap block
-	// contains the in-use bits for BLKBITSIZE blocks.  There are
-	// super->s_nblocks blocks in the disk altogether.
+	return alloc_block_near(0);
+}
 
-	// LAB 5: Your code here.
-	// panic("alloc_block not implemented");
-	for (uint32_t i = 3; i < super->s_nblocks; i++)
-	{
-		if (block_is_free(i))
-		{
-			bitmap[i / 32] &= ~(1 << (i % 32));
-			flush_block(bitmap);
-			return i;
-		}
-	}
-	return -E_NO_DISK;
+// Like alloc_block, but try for block 'goal' first (see find_block).
+int
+alloc_block_near(uint32_t goal)
+{
+	uint32_t blockno;
+
+	if ((blockno = find_block(goal)) == 0)
+		return -E_NO_DISK;
+	take_block(blockno);
+	if (!tmpfs_block(blockno))
+		flush_meta(&bitmap[blockno / 32]);
+	return blockno;
+}
+
+// Allocate up to 'want' consecutive blocks, the first one chosen as
+// alloc_block_near(goal) would.  Sets *len to the number allocated.
+// Returns the first block number, or -E_NO_DISK.
+int
+alloc_run(uint32_t goal, uint32_t want, uint32_t *len)
+{
+	uint32_t start, n, i;
+
+	if ((start = find_block(goal)) == 0)
+		return -E_NO_DISK;
+	for (n = 0; n < want && block_is_free(start + n); n++)
+		take_block(start + n);
+	// the tmpfs's bitmap isn't on the disk
+	if (!tmpfs_block(start))
+		for (i = start / BLKBITSIZE; i <= (start + n - 1) / BLKBITSIZE; i++)
+			flush_meta(diskaddr(2 + i));
+	*len = n;
+	return start;
 }
 
-// Validate the file system bitmap.
-//
 // Check that all reserved blocks -- 0, 1, and the bitmap blocks themselves --
 // are all marked as in-use.
 void
@@ -107,11 +226,18 @@ fs_init(void)
 {
 	static_assert(sizeof(struct File) == 256);
 
-	// Find a JOS disk.  Use the second IDE disk (number 1) if available
-	if (ide_probe_disk1())
+	// Find a JOS disk.  Use a virtio-blk disk, or else the second IDE
+	// disk (number 1) if available
+	if (ide_probe_virtio())
+		;
+	else if (ide_probe_disk1())
 		ide_set_disk(1);
 	else
 		ide_set_disk(0);
+#ifdef FS_RAMDISK
+	ramdisk_load();
+#endif
+	journal_init();
 	bc_init();
 
 	// Set "super" to point to the super block.
@@ -121,14 +247,75 @@ fs_init(void)
 	// Set "bitmap" to the beginning of the first bitmap block.
 	bitmap = diskaddr(2);
 	check_bitmap();
-	
+	bitmap_count();
+	check_journal();
+
+#ifdef IDE_BENCH
+	ide_bench();
+#endif
+}
+
+// Set *pblock to the indirect block whose number is in *pslot.  When
+// there is none and 'alloc' is set, allocate a cleared one first.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NOT_FOUND if there is none and alloc was 0.
+//	-E_NO_DISK if there's no space on the disk for it.
+static int
+indirect_get(uint32_t *pslot, bool alloc, uint32_t **pblock)
+{
+	int r;
+
+	if (*pslot == 0) {
+		if (!alloc)
+			return -E_NOT_FOUND;
+		if ((r = alloc_block_near(tmpfs_goal(pslot))) < 0)
+			return r;
+		*pslot = r;
+		memset(diskaddr(r), 0, BLKSIZE);
+		flush_meta(diskaddr(r));
+		flush_meta(pslot);
+	}
+	*pblock = diskaddr(*pslot);
+	return 0;
+}
+
+// The second-level indirect block found last, so that walking a large
+// file block by block reads the double-indirect block only once every
+// NINDIRECT blocks.  Reset whenever indirect blocks are freed.
+static struct {
+	struct File *f;
+	uint32_t slot;		// index into f's double-indirect block
+	uint32_t blockno;	// the indirect block named there
+} walk_cache;
+
+// Set *pblock to the slot'th indirect block under f's double-indirect
+// block, allocating as indirect_get does.
+static int
+dindirect_get(struct File *f, uint32_t slot, bool alloc, uint32_t **pblock)
+{
+	uint32_t *dind;
+	int r;
+
+	if (walk_cache.f == f && walk_cache.slot == slot) {
+		*pblock = diskaddr(walk_cache.blockno);
+		return 0;
+	}
+	if ((r = indirect_get(&f->f_dindirect, alloc, &dind)) < 0
+	    || (r = indirect_get(&dind[slot], alloc, pblock)) < 0)
+		return r;
+	walk_cache.f = f;
+	walk_cache.slot = slot;
+	walk_cache.blockno = dind[slot];
+	return 0;
 }
 
 // Find the disk block number slot for the 'filebno'th block in file 'f'.
 // Set '*ppdiskbno' to point to that slot.
-// The slot will be one of the f->f_direct[] entries,
-// or an entry in the indirect block.
-// When 'alloc' is set, this function will allocate an indirect block
+// The slot will be one of the f->f_direct[] entries, an entry in the
+// indirect block, or an entry in one of the indirect blocks the
+// double-indirect block names.
+// When 'alloc' is set, this function will allocate indirect blocks
 // if necessary.
 //
 // Returns:
@@ -136,7 +323,7 @@ fs_init(void)
 //	-E_NOT_FOUND if the function needed to allocate an indirect block, but
 //		alloc was 0.
 //	-E_NO_DISK if there's no space on the disk for an indirect block.
-//	-E_INVAL if filebno is out of range (it's >= NDIRECT + NINDIRECT).
+//	-E_INVAL if filebno is out of range (it's >= MAXFILEBLKS).
 //
 // Analogy: This is like pgdir_walk for files.
 // Hint: Don't forget to clear any block you allocate.
@@ -144,7 +331,10 @@ static int
 file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool alloc)
 {
 	// LAB 5: Your code here.
-	if (filebno >= NDIRECT + NINDIRECT)
+	uint32_t *indirect_block;
+	int r;
+
+	if (filebno >= MAXFILEBLKS)
 		return -E_INVAL;
 	if (filebno < NDIRECT)
 	{
@@ -153,33 +343,165 @@ file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool all
 		return 0;
 	}
 	// haven't got result from direct blocks, so query indirect ones...
-	uint32_t *indirect_block;
-	if (f->f_indirect == 0)
-	{
-		if (alloc == 0)
-			return -E_NOT_FOUND;
-		
-		// alloc a block for indirect block
-		f->f_indirect = alloc_block();
-		if (f->f_indirect < 0)
-			return f->f_indirect;
-		indirect_block = (uint32_t *)diskaddr(f->f_indirect);
-		// this should trigger a page fault which reads some data from disk
-		// and then we manage to clear the block
-		memset(indirect_block, 0, BLKSIZE);
-	}
-	else
-	{
-		indirect_block = (uint32_t *)diskaddr(f->f_indirect);
+	filebno -= NDIRECT;
+	if (filebno < NINDIRECT)
+		r = indirect_get(&f->f_indirect, alloc, &indirect_block);
+	else {
+		// ...and then the double-indirect ones
+		filebno -= NINDIRECT;
+		r = dindirect_get(f, filebno / NINDIRECT, alloc, &indirect_block);
+		filebno %= NINDIRECT;
 	}
+	if (r < 0)
+		return r;
 	if (ppdiskbno)
-		*ppdiskbno = indirect_block + filebno - NDIRECT;
+		*ppdiskbno = indirect_block + filebno;
+
+	return 0;
+}
+
+// --------------------------------------------------------------
+// Extents
+// --------------------------------------------------------------
+
+#define EXTENT_MIN	8	// blocks preallocated for a new file
+#define EXTENT_MAX	256	// most blocks preallocated at once
+
+// Number of file blocks covered by f's extents.
+static uint32_t
+extent_blocks(struct File *f)
+{
+	uint32_t i, n = 0;
+
+	for (i = 0; i < f->f_nextent; i++)
+		n += f->f_extent[i].e_len;
+	return n;
+}
+
+// Return the disk block holding block 'filebno' of f if one of f's
+// extents covers it, 0 if none does.
+static uint32_t
+extent_lookup(struct File *f, uint32_t filebno)
+{
+	uint32_t i;
+
+	for (i = 0; i < f->f_nextent; i++) {
+		if (filebno < f->f_extent[i].e_len)
+			return f->f_extent[i].e_start + filebno;
+		filebno -= f->f_extent[i].e_len;
+	}
+	return 0;
+}
 
+// Make f's extents cover block 'filebno', which must be the first one
+// they don't, by preallocating a run as long as the file so far,
+// within [EXTENT_MIN, EXTENT_MAX].  The run continues the last extent
+// on disk if it can.  Blocks the block pointers already map are never
+// covered.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NOT_FOUND if the extents can't grow to cover filebno.
+//	-E_NO_DISK if the disk is full.
+static int
+extent_grow(struct File *f, uint32_t filebno)
+{
+	struct Extent *e = f->f_nextent ? &f->f_extent[f->f_nextent - 1] : NULL;
+	uint32_t want, n, len, *pdiskbno;
+	uint32_t goal = e ? e->e_start + e->e_len : tmpfs_goal(f);
+	int start;
+
+	if (filebno != extent_blocks(f))
+		return -E_NOT_FOUND;
+	want = MIN(MAX(filebno, EXTENT_MIN), EXTENT_MAX);
+	for (n = 0; n < want && filebno + n < MAXFILESIZE / BLKSIZE; n++)
+		if (file_block_walk(f, filebno + n, &pdiskbno, 0) == 0 && *pdiskbno)
+			break;
+	if (n == 0)
+		return -E_NOT_FOUND;
+	// a full table can only lengthen its last extent
+	if (f->f_nextent == NEXTENT && !block_is_free(goal))
+		return -E_NOT_FOUND;
+
+	if ((start = alloc_run(goal, n, &len)) < 0)
+		return start;
+	if (e && start == goal)
+		e->e_len += len;
+	else {
+		f->f_extent[f->f_nextent].e_start = start;
+		f->f_extent[f->f_nextent].e_len = len;
+		f->f_nextent++;
+	}
+	flush_meta(f);
+	return 0;
+}
+
+// Free the blocks of f's extents from file block 'nblocks' on.
+static void
+extent_truncate(struct File *f, uint32_t nblocks)
+{
+	uint32_t i, j, keep;
+	struct Extent *e;
+
+	for (i = 0; i < f->f_nextent; i++) {
+		e = &f->f_extent[i];
+		keep = MIN(nblocks, e->e_len);
+		for (j = keep; j < e->e_len; j++)
+			free_block(e->e_start + j);
+		e->e_len = keep;
+		nblocks -= keep;
+	}
+	while (f->f_nextent > 0 && f->f_extent[f->f_nextent - 1].e_len == 0)
+		f->f_nextent--;
+	flush_meta(f);
+}
+
+// Set *pdiskbno to the disk block holding block 'filebno' of f,
+// 0 if there is none.  Unlike file_get_block, never allocates.
+// Returns 0 on success, -E_INVAL if filebno is out of range.
+static int
+file_map_block(struct File *f, uint32_t filebno, uint32_t *pdiskbno)
+{
+	uint32_t *ptr;
+	int r;
+
+	if (f->f_flags & FILE_INLINE) {
+		*pdiskbno = 0;
+		return 0;
+	}
+	if ((*pdiskbno = extent_lookup(f, filebno)) != 0)
+		return 0;
+	if ((r = file_block_walk(f, filebno, &ptr, 0)) == 0)
+		*pdiskbno = *ptr;
+	return r == -E_NOT_FOUND ? 0 : r;
+}
+
+// Move the contents of inline file f to its first block, so that the
+// block pointers and extents can be used.
+static int
+file_uninline(struct File *f)
+{
+	char data[MAXINLINESIZE], *blk;
+	int r;
+
+	memmove(data, f->f_data, f->f_size);
+	memset(f->f_data, 0, sizeof(f->f_data));
+	f->f_flags &= ~FILE_INLINE;
+	if (f->f_size > 0) {
+		if ((r = file_get_block(f, 0, &blk)) < 0) {
+			memmove(f->f_data, data, f->f_size);
+			f->f_flags |= FILE_INLINE;
+			return r;
+		}
+		memmove(blk, data, f->f_size);
+		memset(blk + f->f_size, 0, BLKSIZE - f->f_size);
+	}
+	flush_meta(f);
 	return 0;
 }
 
 // Set *blk to the address in memory where the filebno'th
-// block of file 'f' would be mapped.
+// block of file 'f' would be mapped.  An inline file is moved to
+// blocks first.
 //
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_NO_DISK if a block needed to be allocated but the disk is full.
@@ -190,10 +512,20 @@ int
 file_get_block(struct File *f, uint32_t filebno, char **blk)
 {
 	// LAB 5: Your code here.
-	if (filebno >= NDIRECT + NINDIRECT)
+	if (filebno >= MAXFILEBLKS)
 		return -E_INVAL;
 	int r = 0;
-	uint32_t *ppdiskbno;
+	uint32_t *ppdiskbno, diskbno;
+	if ((f->f_flags & FILE_INLINE) && (r = file_uninline(f)) < 0)
+		return r;
+	// blocks the extents cover, or can grow to cover
+	if ((diskbno = extent_lookup(f, filebno)) != 0
+	    || (extent_grow(f, filebno) == 0
+		&& (diskbno = extent_lookup(f, filebno)) != 0)) {
+		if (blk)
+			*blk = diskaddr(diskbno);
+		return 0;
+	}
 	if ((r = file_block_walk(f, filebno, &ppdiskbno, true)) < 0)
 		return r;
 	if (blk)
@@ -203,18 +535,173 @@ file_get_block(struct File *f, uint32_t filebno, char **blk)
 			*blk = diskaddr(*ppdiskbno);
 			return 0;
 		}
-		// demand allocation
-		int blkno = alloc_block();
+		// demand allocation, right after the file's previous block
+		// if that is free
+		uint32_t goal = 0;
+		if (filebno > 0 && file_map_block(f, filebno - 1, &goal) == 0
+		    && goal)
+			goal++;
+		else
+			goal = tmpfs_goal(f);
+		int blkno = alloc_block_near(goal);
 		if (blkno < 0)
 			return blkno;
 		// update the entry
 		*ppdiskbno = (uint32_t)blkno;
+		flush_meta(ppdiskbno);
 		*blk = diskaddr(*ppdiskbno);
 	}
 
 	return 0;
 }
 
+// --------------------------------------------------------------
+// Hashed directory index
+// --------------------------------------------------------------
+//
+// A directory of more than one block gets an open-addressing hash
+// table from names to slots (entry numbers within the directory),
+// built the first time an entry is added to it.  f_dirhash names a
+// block holding a struct DirHash, which lists the table's blocks.
+// A table word is 0 if empty, else the slot + 1 in the low
+// DH_SLOTBITS bits under the top bits of the name's hash, so most
+// probes for other names are rejected without reading the entry.
+// Directories without an index -- small ones, and those written by
+// older file systems -- are scanned instead.
+
+#define DH_SLOTBITS	20
+#define DH_SLOTMASK	((1 << DH_SLOTBITS) - 1)
+#define DH_TAG(h)	((h) & ~DH_SLOTMASK)
+
+static uint32_t
+name_hash(const char *name)
+{
+	uint32_t h = 2166136261u;	// FNV-1a
+
+	while (*name)
+		h = (h ^ (uint8_t) *name++) * 16777619u;
+	return h;
+}
+
+// Set *file to the slot'th entry of dir.
+static int
+dir_slot(struct File *dir, uint32_t slot, struct File **file)
+{
+	char *blk;
+	int r;
+
+	if ((r = file_get_block(dir, slot / BLKFILES, &blk)) < 0)
+		return r;
+	*file = (struct File*) blk + slot % BLKFILES;
+	return 0;
+}
+
+// Return the address of word i of dh's table.
+static uint32_t *
+dh_word(struct DirHash *dh, uint32_t i)
+{
+	return (uint32_t *) diskaddr(dh->dh_blocks[i / NINDIRECT]) + i % NINDIRECT;
+}
+
+// Find 'name' through dir's index.
+static int
+dirhash_lookup(struct File *dir, const char *name, struct File **file)
+{
+	struct DirHash *dh = diskaddr(dir->f_dirhash);
+	uint32_t h = name_hash(name), mask = dh->dh_nblocks * NINDIRECT - 1;
+	uint32_t i, w;
+	struct File *f;
+	int r;
+
+	for (i = h & mask; (w = *dh_word(dh, i)) != 0; i = (i + 1) & mask) {
+		if (DH_TAG(w) != DH_TAG(h))
+			continue;
+		if ((r = dir_slot(dir, (w & DH_SLOTMASK) - 1, &f)) < 0)
+			return r;
+		if (strcmp(f->f_name, name) == 0) {
+			*file = f;
+			return 0;
+		}
+	}
+	return -E_NOT_FOUND;
+}
+
+// Enter 'slot', named 'name', into dh's table, which has room for it.
+static void
+dirhash_insert(struct DirHash *dh, const char *name, uint32_t slot)
+{
+	uint32_t h = name_hash(name), mask = dh->dh_nblocks * NINDIRECT - 1;
+	uint32_t i;
+
+	for (i = h & mask; *dh_word(dh, i) != 0; i = (i + 1) & mask)
+		;
+	*dh_word(dh, i) = DH_TAG(h) | (slot + 1);
+	flush_meta(dh_word(dh, i));
+	dh->dh_count++;
+}
+
+// Free dir's index; dir goes back to being scanned.
+static void
+dirhash_free(struct File *dir)
+{
+	struct DirHash *dh = diskaddr(dir->f_dirhash);
+	uint32_t i;
+
+	for (i = 0; i < dh->dh_nblocks; i++)
+		free_block(dh->dh_blocks[i]);
+	free_block(dir->f_dirhash);
+	dir->f_dirhash = 0;
+	flush_meta(dir);
+}
+
+// (Re)build dir's index from its entries, with a table that is at
+// most 3/4 full once it holds 'nentries'.  If the table can't be
+// that big or there is no room on the disk, dir is left unindexed.
+static void
+dirhash_build(struct File *dir, uint32_t nentries)
+{
+	struct DirHash *dh;
+	uint32_t n = 1, i, j, *tbl;
+	struct File *f;
+	char *blk;
+
+	while (n * NINDIRECT / 4 * 3 < nentries)
+		n *= 2;
+	if (dir->f_dirhash)
+		dirhash_free(dir);
+	if (n > ARRAY_SIZE(dh->dh_blocks)
+	    || indirect_get(&dir->f_dirhash, 1, (uint32_t **) &dh) < 0)
+		return;
+	for (i = 0; i < n; i++, dh->dh_nblocks++)
+		if (indirect_get(&dh->dh_blocks[i], 1, &tbl) < 0)
+			goto fail;
+
+	for (i = 0; i < dir->f_size / BLKSIZE; i++) {
+		if (file_get_block(dir, i, &blk) < 0)
+			goto fail;
+		f = (struct File*) blk;
+		for (j = 0; j < BLKFILES; j++)
+			if (f[j].f_name[0] != '\0')
+				dirhash_insert(dh, f[j].f_name, i * BLKFILES + j);
+	}
+	flush_meta(dh);
+	return;
+
+fail:
+	dirhash_free(dir);
+}
+
+// Free-slot hints.  Entries are never freed, so every slot of a
+// directory below its hint is known to be in use.
+#define NDIRHINT	16
+
+static struct {
+	struct File *dir;
+	uint32_t slot;
+} dir_hint[NDIRHINT];
+
+#define DIR_HINT(dir)	(&dir_hint[(uintptr_t) (dir) / sizeof(struct File) % NDIRHINT])
+
 // Try to find a file named "name" in dir.  If so, set *file to it.
 //
 // Returns 0 and sets *file on success, < 0 on error.  Errors are:
@@ -227,6 +714,9 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	char *blk;
 	struct File *f;
 
+	if (dir->f_dirhash)
+		return dirhash_lookup(dir, name, file);
+
 	// Search dir for name.
 	// We maintain the invariant that the size of a directory-file
 	// is always a multiple of the file system's block size.
@@ -247,33 +737,51 @@ dir_lookup(struct File *dir, const char *name, struct File **file)
 	return -E_NOT_FOUND;
 }
 
-// Set *file to point at a free File structure in dir.  The caller is
-// responsible for filling in the File fields.
+// Set *file to point at a free File structure in dir, cleared and
+// named 'name', and enter it in dir's index.  The caller is
+// responsible for filling in the other File fields.
 static int
-dir_alloc_file(struct File *dir, struct File **file)
+dir_alloc_file(struct File *dir, const char *name, struct File **file)
 {
 	int r;
-	uint32_t nblock, i, j;
+	uint32_t slot, nslot;
 	char *blk;
 	struct File *f;
+	struct DirHash *dh;
 
 	assert((dir->f_size % BLKSIZE) == 0);
-	nblock = dir->f_size / BLKSIZE;
-	for (i = 0; i < nblock; i++) {
-		if ((r = file_get_block(dir, i, &blk)) < 0)
+	nslot = dir->f_size / BLKSIZE * BLKFILES;
+	slot = DIR_HINT(dir)->dir == dir ? DIR_HINT(dir)->slot : 0;
+	for (; slot < nslot; slot++) {
+		if ((r = dir_slot(dir, slot, &f)) < 0)
 			return r;
-		f = (struct File*) blk;
-		for (j = 0; j < BLKFILES; j++)
-			if (f[j].f_name[0] == '\0') {
-				*file = &f[j];
-				return 0;
-			}
+		if (f->f_name[0] == '\0')
+			goto found;
 	}
 	dir->f_size += BLKSIZE;
-	if ((r = file_get_block(dir, i, &blk)) < 0)
+	if ((r = file_get_block(dir, slot / BLKFILES, &blk)) < 0)
 		return r;
+	// the block may have belonged to another file before
+	memset(blk, 0, BLKSIZE);
 	f = (struct File*) blk;
-	*file = &f[0];
+
+found:
+	memset(f, 0, sizeof(*f));
+	strcpy(f->f_name, name);
+	flush_meta(f);
+	flush_meta(dir);
+	DIR_HINT(dir)->dir = dir;
+	DIR_HINT(dir)->slot = slot + 1;
+
+	if (dir->f_dirhash) {
+		dh = diskaddr(dir->f_dirhash);
+		if (dh->dh_count + 1 <= dh->dh_nblocks * NINDIRECT / 4 * 3)
+			dirhash_insert(dh, name, slot);
+		else
+			dirhash_build(dir, 2 * (dh->dh_count + 1));
+	} else if (dir->f_size > BLKSIZE)
+		dirhash_build(dir, dir->f_size / sizeof(struct File));
+	*file = f;
 	return 0;
 }
 
@@ -286,6 +794,58 @@ skip_slash(const char *p)
 	return p;
 }
 
+// --------------------------------------------------------------
+// Name cache
+// --------------------------------------------------------------
+
+#define NDCACHE		256	// entries, direct-mapped
+
+// Recent dir_lookup results: a directory and a name in it, and the
+// File found, or NULL if the name isn't there.  File pointers stay
+// valid even when the block cache evicts their block.
+static struct Dentry {
+	struct File *d_dir;
+	struct File *d_file;
+	char d_name[MAXNAMELEN];
+} dcache[NDCACHE];
+
+static struct Dentry *
+dcache_slot(struct File *dir, const char *name)
+{
+	return &dcache[(name_hash(name) ^ (uintptr_t) dir / sizeof(struct File))
+		       % NDCACHE];
+}
+
+// Record that 'name' in dir is f (NULL if there is no such file).
+static void
+dcache_enter(struct File *dir, const char *name, struct File *f)
+{
+	struct Dentry *d = dcache_slot(dir, name);
+
+	d->d_dir = dir;
+	d->d_file = f;
+	strcpy(d->d_name, name);
+}
+
+// dir_lookup, answered from the name cache when it can be.
+static int
+dir_lookup_cached(struct File *dir, const char *name, struct File **file)
+{
+	struct Dentry *d = dcache_slot(dir, name);
+	int r;
+
+	if (d->d_dir == dir && strcmp(d->d_name, name) == 0) {
+		bc_stats.dc_hits++;
+		*file = d->d_file;
+		return d->d_file ? 0 : -E_NOT_FOUND;
+	}
+	bc_stats.dc_misses++;
+	r = dir_lookup(dir, name, file);
+	if (r == 0 || r == -E_NOT_FOUND)
+		dcache_enter(dir, name, r == 0 ? *file : NULL);
+	return r;
+}
+
 // Evaluate a path name, starting at the root.
 // On success, set *pf to the file we found
 // and set *pdir to the directory the file is in.
@@ -324,7 +884,7 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 		if (dir->f_type != FTYPE_DIR)
 			return -E_NOT_FOUND;
 
-		if ((r = dir_lookup(dir, name, &f)) < 0) {
+		if ((r = dir_lookup_cached(dir, name, &f)) < 0) {
 			if (r == -E_NOT_FOUND && *path == '\0') {
 				if (pdir)
 					*pdir = dir;
@@ -334,6 +894,7 @@ walk_path(const char *path, struct File **pdir, struct File **pf, char *lastelem
 			}
 			return r;
 		}
+		f = tmpfs_cover(f);
 	}
 
 	if (pdir)
@@ -359,12 +920,16 @@ file_create(const char *path, struct File **pf)
 		return -E_FILE_EXISTS;
 	if (r != -E_NOT_FOUND || dir == 0)
 		return r;
-	if ((r = dir_alloc_file(dir, &f)) < 0)
+	if ((r = dir_alloc_file(dir, name, &f)) < 0)
 		return r;
+	// small until written to
+	f->f_flags = FILE_INLINE;
+	// replaces the negative entry walk_path just made
+	dcache_enter(dir, name, f);
 
-	strcpy(f->f_name, name);
 	*pf = f;
-	file_flush(dir);
+	if (WB_MAXAGE == 0)
+		file_flush(dir);
 	return 0;
 }
 
@@ -386,11 +951,18 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 	off_t pos;
 	char *blk;
 
+	if (offset < 0)
+		return -E_INVAL;
 	if (offset >= f->f_size)
 		return 0;
 
 	count = MIN(count, f->f_size - offset);
 
+	if (f->f_flags & FILE_INLINE) {
+		memmove(buf, f->f_data + offset, count);
+		return count;
+	}
+
 	for (pos = offset; pos < offset + count; ) {
 		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
 			return r;
@@ -403,6 +975,33 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 	return count;
 }
 
+// Start reading blocks [filebno, filebno + nblocks) of f, as far as
+// they exist, into the block cache ahead of use.  Blocks laid out
+// consecutively on disk are read with a single command.  Returns how
+// many of them are not in the cache yet (see bc_prefetch).
+int
+file_prefetch(struct File *f, uint32_t filebno, uint32_t nblocks)
+{
+	uint32_t diskbno, end, run = 0, runlen = 0;
+	int missing = 0;
+
+	end = MIN(filebno + nblocks, ROUNDUP(f->f_size, BLKSIZE) / BLKSIZE);
+	for (; filebno < end; filebno++) {
+		if (file_map_block(f, filebno, &diskbno) < 0 || diskbno == 0)
+			break;
+		if (runlen && diskbno == run + runlen) {
+			runlen++;
+			continue;
+		}
+		if (runlen)
+			missing += bc_prefetch(run, runlen);
+		run = diskbno;
+		runlen = 1;
+	}
+	if (runlen)
+		missing += bc_prefetch(run, runlen);
+	return missing;
+}
 
 // Write count bytes from buf into f, starting at seek position
 // offset.  This is meant to mimic the standard pwrite function.
@@ -415,11 +1014,19 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 	off_t pos;
 	char *blk;
 
+	if (offset < 0)
+		return -E_INVAL;
 	// Extend file if necessary
 	if (offset + count > f->f_size)
 		if ((r = file_set_size(f, offset + count)) < 0)
 			return r;
 
+	if (f->f_flags & FILE_INLINE) {
+		memmove(f->f_data + offset, buf, count);
+		flush_meta(f);
+		return count;
+	}
+
 	for (pos = offset; pos < offset + count; ) {
 		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
 			return r;
@@ -441,10 +1048,11 @@ file_free_block(struct File *f, uint32_t filebno)
 	uint32_t *ptr;
 
 	if ((r = file_block_walk(f, filebno, &ptr, 0)) < 0)
-		return r;
+		return r == -E_NOT_FOUND ? 0 : r;
 	if (*ptr) {
 		free_block(*ptr);
 		*ptr = 0;
+		flush_meta(ptr);
 	}
 	return 0;
 }
@@ -457,6 +1065,8 @@ file_free_block(struct File *f, uint32_t filebno)
 // been allocated (f->f_indirect != 0), then free the indirect block too.
 // (Remember to clear the f->f_indirect pointer so you'll know
 // whether it's valid!)
+// The block pointers only map blocks after those the extents cover,
+// and the extents are trimmed to new_nblocks as well.
 // Do not change f->f_size.
 static void
 file_truncate_blocks(struct File *f, off_t newsize)
@@ -466,46 +1076,107 @@ file_truncate_blocks(struct File *f, off_t newsize)
 
 	old_nblocks = (f->f_size + BLKSIZE - 1) / BLKSIZE;
 	new_nblocks = (newsize + BLKSIZE - 1) / BLKSIZE;
-	for (bno = new_nblocks; bno < old_nblocks; bno++)
+	for (bno = MAX(new_nblocks, extent_blocks(f)); bno < old_nblocks; bno++)
 		if ((r = file_free_block(f, bno)) < 0)
 			cprintf("warning: file_free_block: %e", r);
+	extent_truncate(f, new_nblocks);
 
 	if (new_nblocks <= NDIRECT && f->f_indirect) {
 		free_block(f->f_indirect);
 		f->f_indirect = 0;
 	}
+
+	// the same for the double-indirect block and the indirect blocks
+	// under it
+	if (f->f_dindirect) {
+		uint32_t *dind = diskaddr(f->f_dindirect), i, keep = 0;
+
+		if (new_nblocks > NDIRECT + NINDIRECT)
+			keep = ROUNDUP(new_nblocks - NDIRECT - NINDIRECT, NINDIRECT) / NINDIRECT;
+		for (i = keep; i < NINDIRECT; i++)
+			if (dind[i]) {
+				free_block(dind[i]);
+				dind[i] = 0;
+				flush_meta(&dind[i]);
+			}
+		if (keep == 0) {
+			free_block(f->f_dindirect);
+			f->f_dindirect = 0;
+		}
+		walk_cache.f = NULL;
+	}
 }
 
 // Set the size of file f, truncating or extending as necessary.
+// An inline file that outgrows its File moves to blocks, and a
+// regular file truncated to nothing goes back inline.
 int
 file_set_size(struct File *f, off_t newsize)
 {
-	if (f->f_size > newsize)
+	int r;
+
+	if (newsize < 0 || newsize > MAXFILESIZE)
+		return -E_INVAL;
+	if ((f->f_flags & FILE_INLINE) && newsize > MAXINLINESIZE
+	    && (r = file_uninline(f)) < 0)
+		return r;
+	if (f->f_flags & FILE_INLINE) {
+		// what is past the end must read as zeroes if it grows again
+		if (f->f_size > newsize)
+			memset(f->f_data + newsize, 0, f->f_size - newsize);
+	} else if (f->f_size > newsize) {
 		file_truncate_blocks(f, newsize);
+		if (newsize == 0 && f->f_type == FTYPE_REG) {
+			memset(f->f_data, 0, sizeof(f->f_data));
+			f->f_flags |= FILE_INLINE;
+		}
+	}
 	f->f_size = newsize;
-	flush_block(f);
+	flush_meta(f);
 	return 0;
 }
 
 // Flush the contents and metadata of file f out to disk.
 // Loop over all the blocks in file.
-// Translate the file block number into a disk block number
-// and then check whether that disk block is dirty.  If so, write it out.
+// Translate the file block number into a disk block number, and
+// write out the dirty ones, a run of consecutive disk blocks at a time.
 void
 file_flush(struct File *f)
 {
 	int i;
-	uint32_t *pdiskbno;
+	uint32_t diskbno, run = 0, runlen = 0;
+
+	// give back what the extents preallocated past the end
+	if (!(f->f_flags & FILE_INLINE))
+		extent_truncate(f, (f->f_size + BLKSIZE - 1) / BLKSIZE);
+	// a tmpfs's blocks only go to its RAM disk when evicted
+	if (tmpfs_block(((uint32_t) f - DISKMAP) / BLKSIZE))
+		return;
 
 	for (i = 0; i < (f->f_size + BLKSIZE - 1) / BLKSIZE; i++) {
-		if (file_block_walk(f, i, &pdiskbno, 0) < 0 ||
-		    pdiskbno == NULL || *pdiskbno == 0)
+		if (file_map_block(f, i, &diskbno) < 0 || diskbno == 0)
+			continue;
+		if (runlen && diskbno == run + runlen) {
+			runlen++;
 			continue;
-		flush_block(diskaddr(*pdiskbno));
+		}
+		if (runlen)
+			flush_blocks(run, runlen);
+		run = diskbno;
+		runlen = 1;
 	}
+	if (runlen)
+		flush_blocks(run, runlen);
 	flush_block(f);
-	if (f->f_indirect)
+	if (!(f->f_flags & FILE_INLINE) && f->f_indirect)
 		flush_block(diskaddr(f->f_indirect));
+	// the metadata that finds these blocks must be on disk too: in
+	// the journal, or else with delayed write-back the bitmap bits
+	// may still be dirty
+	if (journal_enabled())
+		journal_commit();
+	else if (WB_MAXAGE)
+		flush_blocks(2, (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE);
 }
 
 
@@ -513,8 +1184,7 @@ file_flush(struct File *f)
 void
 fs_sync(void)
 {
-	int i;
-	for (i = 1; i < super->s_nblocks; i++)
-		flush_block(diskaddr(i));
+	journal_commit();
+	bc_sync();
 }
 
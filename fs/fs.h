@@ -11,29 +11,104 @@
 /* Maximum disk size we can handle (3GB) */
 #define DISKSIZE	0xC0000000
 
+/* Delayed write-back: metadata blocks are left dirty in the cache and
+ * a background pass writes out everything dirty every WB_MAXAGE msec,
+ * so no block stays dirty for longer than that.  FSREQ_SYNC and
+ * FSREQ_FLUSH still write through.  0 writes metadata through at once,
+ * or on journaled disks commits it at the end of every request. */
+#ifndef WB_MAXAGE
+#define WB_MAXAGE	1000
+#endif
+
 struct Super *super;		// superblock
 uint32_t *bitmap;		// bitmap blocks mapped in memory
+extern struct BcStats bc_stats;	// block cache statistics
+
+/* A disk command, see ide_submit */
+struct IdeReq {
+	uint32_t secno;
+	void *dst;		// with IDE_IOV, the list of its pages
+	size_t nsecs;
+	int op;			// 0 read, 1 write, maybe | IDE_IOV
+	bool done;
+};
+
+/* A read or write of whole blocks, see ios_submit */
+struct IoReq {
+	uint32_t blockno;
+	uint32_t nblocks;
+	char *va;		// nblocks pages, one per block
+	int flags;
+	bool done;
+	uint32_t queued;	// sys_time_msec() when submitted
+	struct IoReq *next;	// in the queue, then in its command
+};
+#define IOR_WRITE	0x1
+#define IOR_BACKGROUND	0x2	// write-back; everything else goes first
 
 /* ide.c */
 bool	ide_probe_disk1(void);
+bool	ide_probe_virtio(void);
 void	ide_set_disk(int diskno);
 void	ide_set_partition(uint32_t first_sect, uint32_t nsect);
 int	ide_read(uint32_t secno, void *dst, size_t nsecs);
 int	ide_write(uint32_t secno, const void *src, size_t nsecs);
+int	ide_submit(struct IdeReq *req);
+void	ide_intr(void);
+void	ide_sleep(void);
+
+/* iosched.c */
+void	ios_submit(struct IoReq *r);
+void	ios_intr(void);
+void	ios_wait(struct IoReq *r);
+void	ios_rw(uint32_t blockno, void *va, uint32_t nblocks, int flags);
+
+/* ramdisk.c */
+int	ramdisk_attach(uint32_t first, uint32_t nblocks);
+bool	ramdisk_owns(uint32_t secno);
+void	ramdisk_rw(uint32_t secno, void *buf, size_t nsecs, int op);
+void	ramdisk_discard(uint32_t blockno);
+void	ramdisk_load(void);
 
 /* bc.c */
 void*	diskaddr(uint32_t blockno);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
 void	flush_block(void *addr);
+void	flush_meta(void *addr);
+void	share_block(void *addr);
+int	bc_prefetch(uint32_t blockno, uint32_t nblocks);
+int	bc_reap(void);
+void	flush_blocks(uint32_t blockno, uint32_t nblocks);
+void	bc_sync(void);
 void	bc_init(void);
 
+/* journal.c */
+bool	journal_enabled(void);
+bool	journal_holds(uint32_t blockno, uint32_t nblocks);
+void	journal_add(void *addr);
+void	journal_commit(void);
+void	journal_init(void);
+void	check_journal(void);
+
+/* tmpfs.c */
+bool	tmpfs_block(uint32_t blockno);
+bool	tmpfs_near(uint32_t goal);
+bool	tmpfs_is_free(uint32_t blockno);
+uint32_t tmpfs_find(uint32_t goal);
+void	tmpfs_take(uint32_t blockno);
+void	tmpfs_free(uint32_t blockno);
+uint32_t tmpfs_goal(void *owner);
+struct File *tmpfs_cover(struct File *f);
+int	tmpfs_mount(const char *path);
+
 /* fs.c */
 void	fs_init(void);
 int	file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
 int	file_create(const char *path, struct File **f);
 int	file_open(const char *path, struct File **f);
 ssize_t	file_read(struct File *f, void *buf, size_t count, off_t offset);
+int	file_prefetch(struct File *f, uint32_t filebno, uint32_t nblocks);
 int	file_write(struct File *f, const void *buf, size_t count, off_t offset);
 int	file_set_size(struct File *f, off_t newsize);
 void	file_flush(struct File *f);
@@ -43,7 +118,11 @@ void	fs_sync(void);
 /* int	map_block(uint32_t); */
 bool	block_is_free(uint32_t blockno);
 int	alloc_block(void);
+int	alloc_block_near(uint32_t goal);
+void	free_block(uint32_t blockno);
+int	alloc_run(uint32_t goal, uint32_t want, uint32_t *len);
 
 /* test.c */
 void	fs_test(void);
+void	ide_bench(void);
 
@@ -33,6 +33,7 @@ typedef int bool;
 
 #define ROUNDUP(n, v) ((n) - 1 + (v) - ((n) - 1) % (v))
 #define MAX_DIR_ENTS 128
+#define MAXBLOCKS (0xC0000000 / BLKSIZE)	// DISKSIZE in fs/fs.h
 
 struct Dir
 {
@@ -117,6 +118,10 @@ opendisk(const char *name)
 	nbitblocks = (nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
 	bitmap = alloc(nbitblocks * BLKSIZE);
 	memset(bitmap, 0xFF, nbitblocks * BLKSIZE);
+
+	// an empty journal: its header has no magic number yet
+	super->s_njournal = NJOURNAL + 1;
+	super->s_journal = blockof(alloc(super->s_njournal * BLKSIZE));
 }
 
 void
@@ -134,16 +139,13 @@ finishdisk(void)
 void
 finishfile(struct File *f, uint32_t start, uint32_t len)
 {
-	int i;
+	// the file's blocks are consecutive, so one extent maps them all
 	f->f_size = len;
 	len = ROUNDUP(len, BLKSIZE);
-	for (i = 0; i < len / BLKSIZE && i < NDIRECT; ++i)
-		f->f_direct[i] = start + i;
-	if (i == NDIRECT) {
-		uint32_t *ind = alloc(BLKSIZE);
-		f->f_indirect = blockof(ind);
-		for (; i < len / BLKSIZE; ++i)
-			ind[i - NDIRECT] = start + i;
+	if (len > 0) {
+		f->f_nextent = 1;
+		f->f_extent[0].e_start = start;
+		f->f_extent[0].e_len = len / BLKSIZE;
 	}
 }
 
@@ -151,7 +153,7 @@ void
 startdir(struct File *f, struct Dir *dout)
 {
 	dout->f = f;
-	dout->ents = malloc(MAX_DIR_ENTS * sizeof *dout->ents);
+	dout->ents = calloc(MAX_DIR_ENTS, sizeof *dout->ents);
 	dout->n = 0;
 }
 
@@ -202,9 +204,16 @@ writefile(struct Dir *dir, const char *name)
 		last = name;
 
 	f = diradd(dir, FTYPE_REG, last);
-	start = alloc(st.st_size);
-	readn(fd, start, st.st_size);
-	finishfile(f, blockof(start), st.st_size);
+	if (st.st_size <= MAXINLINESIZE) {
+		// small enough to keep in the directory entry
+		readn(fd, f->f_data, st.st_size);
+		f->f_size = st.st_size;
+		f->f_flags = FILE_INLINE;
+	} else {
+		start = alloc(st.st_size);
+		readn(fd, start, st.st_size);
+		finishfile(f, blockof(start), st.st_size);
+	}
 	close(fd);
 }
 
@@ -228,7 +237,7 @@ main(int argc, char **argv)
 		usage();
 
 	nblocks = strtol(argv[2], &s, 0);
-	if (*s || s == argv[2] || nblocks < 2 || nblocks > 1024)
+	if (*s || s == argv[2] || nblocks < 2 || nblocks > MAXBLOCKS)
 		usage();
 
 	opendisk(argv[1]);
@@ -1,5 +1,7 @@
 /*
- * Minimal PIO-based (non-interrupt-driven) IDE driver code.
+ * Minimal IDE driver code.  The fs server sets up the drive's
+ * registers; the kernel starts the command and moves the data, by
+ * bus-master DMA if it can (see kern/ide.c).
  * For information about what all this IDE/ATA magic means,
  * see the materials available on the class references page.
  */
@@ -13,6 +15,7 @@
 #define IDE_ERR		0x01
 
 static int diskno = 1;
+static bool vblk;	// the disk is virtio-blk instead
 
 static int
 ide_wait_ready(bool check_error)
@@ -51,19 +54,42 @@ ide_probe_disk1(void)
 	return (x < 1000);
 }
 
+// Have multi-sector commands interrupt once per block, which is how
+// the kernel moves their data without DMA (see kern/ide.c).
+static void
+ide_set_multiple(void)
+{
+	ide_wait_ready(0);
+
+	outb(0x1F2, BLKSECTS);
+	outb(0x1F6, 0xE0 | ((diskno&1)<<4));
+
+	sys_ide_sleep(NULL, BLKSECTS, 2);
+}
+
+// Use the virtio-blk disk if there is one (see kern/virtio.c).  It
+// takes many commands at once.
+bool
+ide_probe_virtio(void)
+{
+	vblk = sys_vblk_reap(NULL, 0) >= 0;
+	cprintf("virtio-blk presence: %d\n", vblk);
+	return vblk;
+}
+
 void
 ide_set_disk(int d)
 {
 	if (d != 0 && d != 1)
 		panic("bad disk number");
 	diskno = d;
+	ide_set_multiple();
 }
 
-int
-ide_read(uint32_t secno, void *dst, size_t nsecs)
+// Send the drive the address and length of a command.
+static void
+ide_command(uint32_t secno, size_t nsecs)
 {
-	int r;
-
 	assert(nsecs <= 256);
 
 	ide_wait_ready(0);
@@ -73,36 +99,124 @@ ide_read(uint32_t secno, void *dst, size_t nsecs)
 	outb(0x1F4, (secno >> 8) & 0xFF);
 	outb(0x1F5, (secno >> 16) & 0xFF);
 	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-
-	// between issuing disk cmd and set to sleep, there might be a timer IRQ
-	// comes in, and fs -> RUNNABLE, then disk IRQ comes, and we handle it
-	// then fs goes to sleep, with CPU halted, we missed wake up
-	sys_ide_sleep(dst, nsecs, 0);
-
-	return 0;
 }
 
+// Commands started with ide_submit.  The IDE drive runs one at a time.
+static struct IdeReq *ide_active;
+static int vblk_inflight;
+
+// Start req at once, without waiting for it (the RAM disk finishes it
+// before returning): req->op is 0 to read
+// req->nsecs sectors at req->secno into req->dst, 1 to write them from
+// there, maybe with IDE_IOV (see sys_ide_sleep).  req->done is set
+// once the data has moved, which the fs server learns of from
+// ide_intr() or by waiting with ide_sleep().
+//
+// Returns -E_NO_MEM if the disk can't take another command now.
 int
-ide_write(uint32_t secno, const void *src, size_t nsecs)
+ide_submit(struct IdeReq *req)
 {
 	int r;
 
-	assert(nsecs <= 256);
-
-	ide_wait_ready(0);
+	req->done = 0;
+	if (ramdisk_owns(req->secno)) {
+		ramdisk_rw(req->secno, req->dst, req->nsecs, req->op);
+		req->done = 1;
+		return 0;
+	}
+	if (vblk) {
+		if ((r = sys_vblk_submit((uint32_t) req, req->secno, req->dst,
+					 req->nsecs, req->op)) == -E_NO_MEM)
+			return r;
+		if (r < 0)
+			panic("sys_vblk_submit: %e", r);
+		vblk_inflight++;
+		return 0;
+	}
+	if (ide_active)
+		return -E_NO_MEM;
+	ide_active = req;
+	ide_command(req->secno, req->nsecs);
+	sys_ide_sleep(req->dst, req->nsecs, IDE_ASYNC | req->op);
+	return 0;
+}
 
-	outb(0x1F2, nsecs);
-	outb(0x1F3, secno & 0xFF);
-	outb(0x1F4, (secno >> 8) & 0xFF);
-	outb(0x1F5, (secno >> 16) & 0xFF);
-	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
+// The kernel reported (as an IPC from envid 0) that the drive finished
+// its command, or that virtio-blk requests are done: mark them done.
+void
+ide_intr(void)
+{
+	uint32_t tags[32];
+	int i, n;
+
+	if (vblk) {
+		while ((n = sys_vblk_reap(tags, ARRAY_SIZE(tags))) > 0)
+			for (i = 0; i < n; i++) {
+				((struct IdeReq *) tags[i])->done = 1;
+				vblk_inflight--;
+			}
+	} else if (ide_active) {
+		ide_active->done = 1;
+		ide_active = NULL;
+	}
+}
 
-	sys_ide_sleep((void *)src, nsecs, 1);
+// Sleep until a command started with ide_submit is done, if any is
+// in flight, and mark it done.
+void
+ide_sleep(void)
+{
+	if (vblk ? vblk_inflight == 0 : ide_active == NULL)
+		return;
+	sys_ide_sleep(NULL, 0, IDE_WAIT);
+	ide_intr();
+}
 
+// Read or write, and wait for the disk.  The IDE drive's command in
+// flight, if any, is finished first; the virtio-blk disk's can go on.
+static int
+ide_rw(uint32_t secno, void *buf, size_t nsecs, int op)
+{
+	struct IdeReq req = { secno, buf, nsecs, op };
+
+	if (ramdisk_owns(secno)) {
+		ramdisk_rw(secno, buf, nsecs, op);
+		return 0;
+	}
+	if (!vblk) {
+		ide_sleep();
+		ide_command(secno, nsecs);
+
+		// between issuing disk cmd and set to sleep, there might be a timer IRQ
+		// comes in, and fs -> RUNNABLE, then disk IRQ comes, and we handle it
+		// then fs goes to sleep, with CPU halted, we missed wake up
+		sys_ide_sleep(buf, nsecs, op);
+		return 0;
+	}
+
+	// the queue is full: wait for some to finish
+	while (ide_submit(&req) < 0)
+		ide_sleep();
+	while (!req.done)
+		ide_sleep();
 	return 0;
 }
 
-/* 
+// ide_read and ide_write bypass the I/O scheduler (see iosched.c);
+// only fs_init and the benchmark use them directly.
+int
+ide_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	return ide_rw(secno, dst, nsecs, 0);
+}
+
+int
+ide_write(uint32_t secno, const void *src, size_t nsecs)
+{
+	return ide_rw(secno, (void *) src, nsecs, 1);
+}
+
+/*
 
 0. non-fs env raises a fs request and sleep
 1. fs might issue read/write command
@@ -111,7 +225,10 @@ ide_write(uint32_t secno, const void *src, size_t nsecs)
 4. fs in turn wakes up env that waits
 5. fs serv goes for another run
 
-So basically we can only handle one IRQ each
-time (since fs env will sleep after each disk command),
-we can support concurrency by implementing 'thread' in JOS
-*/
\ No newline at end of file
+That is how ide_read and ide_write still work.  Commands started with
+ide_submit skip step 2: the fs goes back to serving requests whose
+blocks are cached, and in step 3 the kernel hands it the news as an
+IPC from envid 0 (see serve() in fs/serv.c).  The IDE drive still has
+one command at a time; the I/O scheduler (iosched.c) keeps the others
+until it is free.  A virtio-blk disk takes many at once.
+*/
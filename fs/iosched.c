@@ -0,0 +1,213 @@
+/*
+ * Disk I/O scheduler, between the block cache and the disk driver.
+ *
+ * The block cache and the journal read and write through here, as
+ * struct IoReq.  Requests wait in ios_queue until the disk can take
+ * another command -- the IDE drive one at a time, a virtio-blk disk
+ * up to IOS_NCMD -- so what goes next is decided as late as possible:
+ *
+ *  - Requests someone waits for, reads above all, go before
+ *    background write-back (IOR_BACKGROUND).
+ *  - Among those, C-LOOK: the lowest-numbered request at or past the
+ *    end of the last command, or if there is none the lowest of all,
+ *    so the disk sweeps upwards and then jumps back.
+ *  - Queued requests in the same direction for the blocks just before
+ *    or after it join the chosen one in a single command of up to
+ *    IOS_MAXBLKS blocks.  Their pages can be anywhere: the command
+ *    lists them (IDE_IOV).
+ *
+ * The time each request spent from ios_submit until done goes into
+ * bc_stats.
+ *
+ * Requests in the queue together never overlap: reads are only of
+ * blocks that aren't in the cache, and writes of blocks that are.
+ */
+
+#include "fs.h"
+
+#define IOS_NCMD	8			// commands in flight, at most
+#define IOS_MAXBLKS	(256 / BLKSECTS)	// blocks in one command
+
+struct IoCmd {
+	struct IdeReq c_ide;
+	struct IoReq *c_reqs;		// in block order, NULL if free
+	uintptr_t c_pages[IOS_MAXBLKS];
+};
+
+static struct IoCmd ios_cmds[IOS_NCMD];
+static struct IoReq *ios_queue;
+static uint32_t ios_head;		// the block after the last command
+
+// Choose the next request: C-LOOK among the most urgent ones.
+// Returns the link to it in ios_queue.
+static struct IoReq **
+ios_pick(void)
+{
+	struct IoReq **pp, **next = NULL, **lowest = NULL, *r;
+	int class = IOR_BACKGROUND;
+
+	for (r = ios_queue; r; r = r->next)
+		if (!(r->flags & IOR_BACKGROUND))
+			class = 0;
+	for (pp = &ios_queue; (r = *pp) != NULL; pp = &r->next) {
+		if ((r->flags & IOR_BACKGROUND) != class)
+			continue;
+		if (!lowest || r->blockno < (*lowest)->blockno)
+			lowest = pp;
+		if (r->blockno >= ios_head && (!next || r->blockno < (*next)->blockno))
+			next = pp;
+	}
+	return next ? next : lowest;
+}
+
+// Take a queued request going the way of 'write' that ends at block
+// 'start' or begins at 'end', and has at most 'room' blocks.
+static struct IoReq *
+ios_take(uint32_t start, uint32_t end, int write, uint32_t room)
+{
+	struct IoReq **pp, *r;
+
+	for (pp = &ios_queue; (r = *pp) != NULL; pp = &r->next)
+		if ((r->flags & IOR_WRITE) == write && r->nblocks <= room
+		    && (r->blockno + r->nblocks == start || r->blockno == end)) {
+			*pp = r->next;
+			return r;
+		}
+	return NULL;
+}
+
+// Finish the requests of every command the disk is done with.
+static void
+ios_complete(void)
+{
+	struct IoReq *r, *next;
+	struct IoCmd *c;
+	uint32_t now = 0, t;
+
+	for (c = ios_cmds; c < ios_cmds + IOS_NCMD; c++) {
+		if (!c->c_reqs || !c->c_ide.done)
+			continue;
+		if (!now)
+			now = sys_time_msec();
+		for (r = c->c_reqs; r; r = next) {
+			next = r->next;
+			t = now - r->queued;
+			if (r->flags & IOR_WRITE) {
+				bc_stats.io_writes++;
+				bc_stats.io_write_msec += t;
+				bc_stats.io_write_max = MAX(bc_stats.io_write_max, t);
+			} else {
+				bc_stats.io_reads++;
+				bc_stats.io_read_msec += t;
+				bc_stats.io_read_max = MAX(bc_stats.io_read_max, t);
+			}
+			r->done = 1;
+		}
+		c->c_reqs = NULL;
+	}
+}
+
+// Give the disk as many commands as it will take.
+static void
+ios_dispatch(void)
+{
+	struct IoReq **pp, *first, *last, *r;
+	struct IoCmd *c;
+	uint32_t n, i, b;
+	int write;
+
+	while (ios_queue) {
+		for (c = ios_cmds; c < ios_cmds + IOS_NCMD && c->c_reqs; c++)
+			;
+		if (c == ios_cmds + IOS_NCMD)
+			return;
+
+		pp = ios_pick();
+		first = last = *pp;
+		*pp = first->next;
+		first->next = NULL;
+		write = first->flags & IOR_WRITE;
+		n = first->nblocks;
+		while ((r = ios_take(first->blockno, last->blockno + last->nblocks,
+				     write, IOS_MAXBLKS - n)) != NULL) {
+			if (r->blockno < first->blockno) {
+				r->next = first;
+				first = r;
+			} else {
+				r->next = NULL;
+				last->next = r;
+				last = r;
+			}
+			n += r->nblocks;
+		}
+
+		for (i = 0, r = first; r; r = r->next)
+			for (b = 0; b < r->nblocks; b++)
+				c->c_pages[i++] = (uintptr_t) r->va + b * BLKSIZE;
+		c->c_ide.secno = first->blockno * BLKSECTS;
+		c->c_ide.dst = c->c_pages;
+		c->c_ide.nsecs = n * BLKSECTS;
+		c->c_ide.op = (write ? 1 : 0) | IDE_IOV;
+		if (ide_submit(&c->c_ide) < 0) {
+			// the disk is full after all; they wait for the next
+			last->next = ios_queue;
+			ios_queue = first;
+			return;
+		}
+		c->c_reqs = first;
+		ios_head = first->blockno + n;
+		bc_stats.io_cmds++;
+		if (c->c_ide.done)
+			ios_complete();
+	}
+}
+
+// Queue r: read r->nblocks blocks at r->blockno into the pages at
+// r->va, which must be there, or with IOR_WRITE write them out.  The
+// caller goes on at once; r->done is set once the disk is done, which
+// the fs server learns of from ios_intr() or by waiting with
+// ios_wait().  The pages must stay until then.
+void
+ios_submit(struct IoReq *r)
+{
+	assert(r->nblocks > 0 && r->nblocks <= IOS_MAXBLKS);
+	r->done = 0;
+	r->queued = sys_time_msec();
+	r->next = ios_queue;
+	ios_queue = r;
+	ios_dispatch();
+}
+
+// The disk finished something (the kernel's IPC from envid 0).
+void
+ios_intr(void)
+{
+	ide_intr();
+	ios_complete();
+	ios_dispatch();
+}
+
+// Wait until r is done.
+void
+ios_wait(struct IoReq *r)
+{
+	while (!r->done) {
+		ide_sleep();
+		ios_complete();
+		ios_dispatch();
+	}
+}
+
+// Read or write nblocks blocks at blockno, and wait for the disk.
+void
+ios_rw(uint32_t blockno, void *va, uint32_t nblocks, int flags)
+{
+	struct IoReq r;
+
+	r.blockno = blockno;
+	r.nblocks = nblocks;
+	r.va = va;
+	r.flags = flags;
+	ios_submit(&r);
+	ios_wait(&r);
+}
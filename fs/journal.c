@@ -0,0 +1,211 @@
+/*
+ * Write-ahead journal for file system metadata.
+ *
+ * Code that changes a metadata block -- the bitmap, a directory, an
+ * indirect block, a File -- calls flush_meta(), which adds the block
+ * to the running transaction.  journal_commit() writes copies of all
+ * of the transaction's blocks to the journal region with one disk
+ * command, then a header naming them; once the header is on disk the
+ * transaction is committed.  Many requests' changes share a commit:
+ * it happens on the write-back pass, FSREQ_SYNC and FSREQ_FLUSH, when
+ * the transaction fills up, or when the block cache is about to write
+ * one of its blocks home.  Writing the blocks home is the checkpoint,
+ * left to the block cache's usual write-back; only the blocks of the
+ * last transaction must be home before the next one reuses the log.
+ *
+ * fs_init() replays the last committed transaction.  Replaying one
+ * that was already checkpointed writes the same contents again, so
+ * the log is never cleared.
+ *
+ * Disks without a journal region (s_njournal == 0) are not journaled.
+ */
+
+#include "fs.h"
+
+// The header, then room for the copies, for one sequential write
+static uint8_t jbuf[(NJOURNAL + 1) * BLKSIZE] __attribute__((aligned(PGSIZE)));
+#define jhdr	((struct JournalHeader *) jbuf)
+
+static uint32_t j_start;		// journal region, 0 if none
+static uint32_t j_seq;			// last transaction number used
+static uint32_t jt_blocks[NJOURNAL];	// the running transaction
+static int jt_n;
+static uint32_t jp_blocks[NJOURNAL];	// the last committed one
+static int jp_n;
+static bool j_committing;
+static bool j_crash;			// check_journal: stop before the header
+
+static uint32_t
+journal_sum(const struct JournalHeader *jh, const void *copies)
+{
+	const uint32_t *p = copies;
+	uint32_t h = 2166136261u, i;	// FNV-1a, a word at a time
+
+	for (i = 0; i < jh->jh_nblocks * BLKSIZE / 4; i++)
+		h = (h ^ p[i]) * 16777619u;
+	for (i = 0; i < jh->jh_nblocks; i++)
+		h = (h ^ jh->jh_blocks[i]) * 16777619u;
+	return (h ^ jh->jh_seq) * 16777619u;
+}
+
+static bool
+in_list(const uint32_t *list, int n, uint32_t blockno)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (list[i] == blockno)
+			return 1;
+	return 0;
+}
+
+bool
+journal_enabled(void)
+{
+	return j_start != 0;
+}
+
+// Is any of [blockno, blockno + nblocks) in the running transaction?
+// Those may not be written home until it commits.
+bool
+journal_holds(uint32_t blockno, uint32_t nblocks)
+{
+	int i;
+
+	for (i = 0; i < jt_n; i++)
+		if (jt_blocks[i] >= blockno && jt_blocks[i] < blockno + nblocks)
+			return 1;
+	return 0;
+}
+
+// Add the block containing addr to the running transaction.
+void
+journal_add(void *addr)
+{
+	uint32_t blockno = ((uint32_t) addr - DISKMAP) / BLKSIZE;
+
+	if (in_list(jt_blocks, jt_n, blockno))
+		return;
+	jt_blocks[jt_n++] = blockno;
+	if (jt_n == NJOURNAL)
+		journal_commit();
+}
+
+// Commit the running transaction.
+void
+journal_commit(void)
+{
+	int i;
+
+	if (jt_n == 0 || j_committing)
+		return;
+	j_committing = 1;
+
+	// Checkpoint the last transaction before its log is overwritten:
+	// until this one's header is on disk, a crash leaves that one's
+	// header with copies that no longer match, and its blocks must
+	// already be home.  Blocks it shares with this one have changed
+	// since, so their home gets the copy logged then, still in jbuf,
+	// not the cached block.
+	for (i = 0; i < jp_n; i++)
+		if (!in_list(jt_blocks, jt_n, jp_blocks[i]))
+			flush_block(diskaddr(jp_blocks[i]));
+		else
+			ios_rw(jp_blocks[i], jbuf + (i + 1) * BLKSIZE, 1, IOR_WRITE);
+
+	for (i = 0; i < jt_n; i++)
+		memmove(jbuf + (i + 1) * BLKSIZE, diskaddr(jt_blocks[i]), BLKSIZE);
+	ios_rw(j_start + 1, jbuf + BLKSIZE, jt_n, IOR_WRITE);
+	if (j_crash) {
+		// the last transaction's blocks are all home now
+		jp_n = 0;
+		j_committing = 0;
+		return;
+	}
+
+	jhdr->jh_magic = JOURNAL_MAGIC;
+	jhdr->jh_seq = ++j_seq;
+	jhdr->jh_nblocks = jt_n;
+	memmove(jhdr->jh_blocks, jt_blocks, jt_n * sizeof(uint32_t));
+	jhdr->jh_sum = journal_sum(jhdr, jbuf + BLKSIZE);
+	ios_rw(j_start, jhdr, 1, IOR_WRITE);
+
+	bc_stats.jn_commits++;
+	bc_stats.jn_logged += jt_n;
+	memmove(jp_blocks, jt_blocks, sizeof(jt_blocks));
+	jp_n = jt_n;
+	jt_n = 0;
+	j_committing = 0;
+}
+
+// Find the journal and replay its last committed transaction.
+// Called before the block cache is set up, so the disk is accessed
+// directly.
+void
+journal_init(void)
+{
+	struct Super *s = (struct Super *) jbuf;
+	uint32_t i;
+
+	// the disk can only read into pages that are there
+	memset(jbuf, 0, sizeof(jbuf));
+
+	ide_read(1 * BLKSECTS, jbuf, BLKSECTS);
+	if (s->s_magic != FS_MAGIC || s->s_njournal < NJOURNAL + 1)
+		return;
+	j_start = s->s_journal;
+
+	ide_read(j_start * BLKSECTS, jhdr, BLKSECTS);
+	if (jhdr->jh_magic != JOURNAL_MAGIC || jhdr->jh_nblocks > NJOURNAL)
+		return;
+	j_seq = jhdr->jh_seq;
+	if (jhdr->jh_nblocks == 0)
+		return;
+	ide_read((j_start + 1) * BLKSECTS, jbuf + BLKSIZE,
+		 jhdr->jh_nblocks * BLKSECTS);
+	if (jhdr->jh_sum != journal_sum(jhdr, jbuf + BLKSIZE)) {
+		cprintf("journal: transaction %d is incomplete, ignored\n", j_seq);
+		return;
+	}
+	for (i = 0; i < jhdr->jh_nblocks; i++)
+		ide_write(jhdr->jh_blocks[i] * BLKSECTS, jbuf + (i + 1) * BLKSIZE,
+			  BLKSECTS);
+	cprintf("journal: replayed transaction %d, %d blocks\n",
+		j_seq, jhdr->jh_nblocks);
+}
+
+// Test that a block logged by two transactions in a row is home with
+// the first one's contents when a crash stops the second one's commit
+// halfway, the first one's log being overwritten by then.
+void
+check_journal(void)
+{
+	static char home[BLKSIZE] __attribute__((aligned(PGSIZE)));
+	char *blk;
+	int blockno;
+
+	if (!journal_enabled())
+		return;
+	if ((blockno = alloc_block()) < 0)
+		panic("check_journal: alloc_block: %e", blockno);
+	blk = diskaddr(blockno);
+
+	strcpy(blk, "first transaction");
+	journal_add(blk);
+	journal_commit();
+
+	strcpy(blk, "second transaction");
+	journal_add(blk);
+	j_crash = 1;
+	journal_commit();
+	j_crash = 0;
+	// the log now holds the second copy under the first header
+	ios_rw(blockno, home, 1, 0);
+	assert(strcmp(home, "first transaction") == 0);
+
+	// finish the commit for real
+	journal_commit();
+	free_block(blockno);
+	journal_commit();
+	cprintf("journal checkpoint is good\n");
+}
@@ -0,0 +1,140 @@
+/*
+ * RAM disk: a block device in the fs server's own memory, behind the
+ * same interface as the disk (fs/ide.c hands it the sectors it owns).
+ * It holds ranges of block numbers, each given pages at RAMDISK as it
+ * is attached; a page is only allocated once its block is written, and
+ * a block never written reads as zeros.  Commands finish at once.
+ *
+ * 'make RAMDISK=1' copies the whole disk into one at startup, so the
+ * file system runs without touching the disk again and nothing it
+ * writes survives a reboot; a tmpfs (see tmpfs.c) keeps its blocks in
+ * one as well.
+ */
+
+#include "fs.h"
+
+// ULIB's range, unused in the statically linked fs server (see
+// inc/memlayout.h), and the largest free one below UENVS
+#define RAMDISK		ULIB
+#define RAMDISK_END	0xEE000000
+#define RAM_NRANGE	2
+
+static struct RamRange {
+	uint32_t r_first;	// first block number
+	uint32_t r_nblocks;
+	char *r_mem;		// where the first block's page goes
+} ram_ranges[RAM_NRANGE];
+
+static char *ram_next = (char *) RAMDISK;
+
+// Keep blocks [first, first + nblocks) in RAM from now on.
+// Returns 0 on success, -E_NO_MEM if there is no room.
+int
+ramdisk_attach(uint32_t first, uint32_t nblocks)
+{
+	struct RamRange *rr;
+
+	for (rr = ram_ranges; rr < ram_ranges + RAM_NRANGE && rr->r_nblocks; rr++)
+		;
+	if (rr == ram_ranges + RAM_NRANGE
+	    || nblocks > (RAMDISK_END - (uintptr_t) ram_next) / BLKSIZE)
+		return -E_NO_MEM;
+	rr->r_first = first;
+	rr->r_nblocks = nblocks;
+	rr->r_mem = ram_next;
+	ram_next += nblocks * BLKSIZE;
+	return 0;
+}
+
+// The page holding block 'blockno', NULL if the block isn't in RAM.
+static char *
+ram_addr(uint32_t blockno)
+{
+	struct RamRange *rr;
+
+	for (rr = ram_ranges; rr < ram_ranges + RAM_NRANGE; rr++)
+		if (blockno >= rr->r_first && blockno - rr->r_first < rr->r_nblocks)
+			return rr->r_mem + (blockno - rr->r_first) * BLKSIZE;
+	return NULL;
+}
+
+// Is the command at secno for the RAM disk?
+bool
+ramdisk_owns(uint32_t secno)
+{
+	return ram_addr(secno / BLKSECTS) != NULL;
+}
+
+// Do a disk command (see ide_submit) on RAM disk blocks.
+void
+ramdisk_rw(uint32_t secno, void *buf, size_t nsecs, int op)
+{
+	uint32_t i, blockno = secno / BLKSECTS;
+	size_t len, total = nsecs * SECTSIZE;
+	char *mem, *va;
+	int r;
+
+	assert(secno % BLKSECTS == 0);
+	for (i = 0; i * BLKSIZE < total; i++) {
+		if ((mem = ram_addr(blockno + i)) == NULL)
+			panic("ramdisk_rw: block %08x is not in RAM", blockno + i);
+		va = (op & IDE_IOV) ? (char *) ((uintptr_t *) buf)[i]
+			: (char *) buf + i * BLKSIZE;
+		len = MIN(total - i * BLKSIZE, BLKSIZE);
+		if ((op & ~IDE_IOV) == 0) {
+			if (va_is_mapped(mem))
+				memmove(va, mem, len);
+			else
+				memset(va, 0, len);
+			continue;
+		}
+		if (!va_is_mapped(mem)
+		    && (r = sys_page_alloc(0, mem, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("ramdisk_rw: %e", r);
+		memmove(mem, va, len);
+	}
+}
+
+// Block 'blockno' is free: give its page back.
+void
+ramdisk_discard(uint32_t blockno)
+{
+	char *mem = ram_addr(blockno);
+
+	if (mem && va_is_mapped(mem))
+		sys_page_unmap(0, mem);
+}
+
+// Copy the whole disk into a RAM disk that takes its place.
+void
+ramdisk_load(void)
+{
+	char *mem = ram_next;
+	struct Super *s = (struct Super *) (mem + BLKSIZE);
+	uint32_t i, j, n, nblocks;
+	int r;
+
+	// the superblock says how much there is
+	if ((r = sys_page_alloc(0, s, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("ramdisk_load: %e", r);
+	ide_read(1 * BLKSECTS, s, BLKSECTS);
+	nblocks = s->s_nblocks;
+	if (s->s_magic != FS_MAGIC)
+		panic("ramdisk_load: bad file system magic number");
+	if (nblocks > (RAMDISK_END - (uintptr_t) mem) / BLKSIZE)
+		panic("ramdisk_load: %d blocks don't fit", nblocks);
+
+	for (i = 0; i < nblocks; i += n) {
+		n = MIN(nblocks - i, 256 / BLKSECTS);
+		for (j = i; j < i + n; j++)
+			if (!va_is_mapped(mem + j * BLKSIZE)
+			    && (r = sys_page_alloc(0, mem + j * BLKSIZE,
+						   PTE_P|PTE_U|PTE_W)) < 0)
+				panic("ramdisk_load: %e", r);
+		ide_read(i * BLKSECTS, mem + i * BLKSIZE, n * BLKSECTS);
+	}
+	// from here on the disk isn't used
+	if ((r = ramdisk_attach(0, nblocks)) < 0)
+		panic("ramdisk_load: %e", r);
+	cprintf("RAM disk: %d blocks loaded\n", nblocks);
+}
@@ -34,8 +34,17 @@ struct OpenFile {
 	struct File *o_file;	// mapped descriptor for open file
 	int o_mode;		// open mode
 	struct Fd *o_fd;	// Fd page
+	off_t o_ra_pos;		// where a sequential read would go next
+	uint32_t o_ra_win;	// read-ahead window in blocks, 0 if random
+	uint32_t o_ra_next;	// first block not yet read ahead
+	struct OpenFile *o_next;	// next on the free list
+	bool o_shared;		// MAP_SHARED pages handed out since last flush
 };
 
+// Read-ahead window bounds, in blocks
+#define RA_MIN		4
+#define RA_MAX		32
+
 // Max number of open files in the file system at once
 #define MAXOPEN		1024
 #define FILEVA		0xD0000000
@@ -45,44 +54,119 @@ struct OpenFile opentab[MAXOPEN] = {
 	{ 0, 0, 1, 0 }
 };
 
-// Virtual address at which to receive page mappings containing client requests.
-union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
+// Open files not in use (o_file == 0), the last freed first
+static struct OpenFile *opentab_free;
+
+// Virtual address at which to receive page mappings containing client
+// requests, followed by room for the data pages of FSREQ_READ_PAGES and
+// FSREQ_WRITE_PAGES, right up to DISKMAP.
+#define REQVA		(DISKMAP - (1 + FSIPC_MAXPAGES) * PGSIZE)
+union Fsipc *fsreq = (union Fsipc *)REQVA;
+
+// The write-back timer environment, see wb_timer
+envid_t wb_envid;
+
+// Requests set aside while the disk reads the file data they need (see
+// serve_fetch), each with its request page moved to PARKVA.  They are
+// tried again whenever reads complete.
+#define NPARK		16
+#define PARKVA		(REQVA - NPARK * PGSIZE)
+#define PARK_TRIES	4	// reads it may see finish before it is
+				// served anyway, faults and all
+
+struct Parked {
+	envid_t p_whom;		// 0 if the slot is free
+	uint32_t p_req;
+	int p_perm;
+	int p_tries;
+};
+
+static struct Parked parked[NPARK];
+
+// File versions for client caches, a page shared with them read-only
+#define VERSVA		(PARKVA - PGSIZE)
+static uint32_t *fvers = (uint32_t *) VERSVA;
+
+// A private page for serve_map to fill and send instead of a block,
+// unmapped again once sent
+#define COPYVA		(VERSVA - PGSIZE)
 
 void
 serve_init(void)
 {
-	int i;
-	uintptr_t va = FILEVA;
-	for (i = 0; i < MAXOPEN; i++) {
+	int i, r;
+	for (i = MAXOPEN - 1; i >= 0; i--) {
 		opentab[i].o_fileid = i;
-		opentab[i].o_fd = (struct Fd*) va;
-		va += PGSIZE;
+		opentab[i].o_fd = (struct Fd*) (FILEVA + i * PGSIZE);
+		opentab[i].o_next = opentab_free;
+		opentab_free = &opentab[i];
 	}
+	if ((r = sys_page_alloc(0, fvers, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("serve_init: %e", r);
+}
+
+// The file number clients know f by: which File on the disk it is.
+static uint32_t
+file_inum(struct File *f)
+{
+	return ((uintptr_t) f - DISKMAP) / sizeof(struct File);
+}
+
+// Note that f's contents or size changed: copies clients cached of
+// it are out of date.
+static void
+file_changed(struct File *f)
+{
+	fvers[file_inum(f) % FS_NVERS]++;
+}
+
+// Put an open file on the free list.
+static void
+openfile_free(struct OpenFile *o)
+{
+	o->o_file = 0;
+	o->o_next = opentab_free;
+	opentab_free = o;
+}
+
+// Free the open files of clients that went away without closing them,
+// killed before they could: nobody but us has their Fd page mapped.
+// Clients that exit or close their files tell us (see serve_flush), so
+// this is only needed once the free list runs out.
+static void
+openfile_reclaim(void)
+{
+	int i;
+
+	for (i = 0; i < MAXOPEN; i++)
+		if (opentab[i].o_file && pageref(opentab[i].o_fd) <= 1)
+			openfile_free(&opentab[i]);
 }
 
 // Allocate an open file.
 int
-openfile_alloc(struct OpenFile **o)
+openfile_alloc(struct OpenFile **po)
 {
-	int i, r;
+	struct OpenFile *o;
+	int r;
 
-	// Find an available open-file table entry
-	for (i = 0; i < MAXOPEN; i++) {
-		switch (pageref(opentab[i].o_fd)) {
-		case 0:
-			// fd page will be actually copy-on-write once after fork
-			// we need to correct this in our fork
-			if ((r = sys_page_alloc(0, opentab[i].o_fd, PTE_P|PTE_U|PTE_W)) < 0)
-				return r;
-			/* fall through */
-		case 1:
-			opentab[i].o_fileid += MAXOPEN;
-			*o = &opentab[i];
-			memset(opentab[i].o_fd, 0, PGSIZE);
-			return (*o)->o_fileid;
-		}
-	}
-	return -E_MAX_OPEN;
+	if (!opentab_free)
+		openfile_reclaim();
+	if (!(o = opentab_free))
+		return -E_MAX_OPEN;
+
+	// A first use has no Fd page yet.  The client freeing the slot may
+	// not have unmapped its page yet: leave that one to it.
+	if (pageref(o->o_fd) != 1) {
+		if ((r = sys_page_alloc(0, o->o_fd, PTE_P|PTE_U|PTE_W)) < 0)
+			return r;
+	} else
+		memset(o->o_fd, 0, PGSIZE);
+	opentab_free = o->o_next;
+	o->o_fileid += MAXOPEN;
+	o->o_shared = 0;
+	*po = o;
+	return o->o_fileid;
 }
 
 // Look up an open file for envid.
@@ -92,7 +176,7 @@ openfile_lookup(envid_t envid, uint32_t fileid, struct OpenFile **po)
 	struct OpenFile *o;
 
 	o = &opentab[fileid % MAXOPEN];
-	if (pageref(o->o_fd) <= 1 || o->o_fileid != fileid)
+	if (!o->o_file || pageref(o->o_fd) <= 1 || o->o_fileid != fileid)
 		return -E_INVAL;
 	*po = o;
 	return 0;
@@ -133,14 +217,14 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 				goto try_open;
 			if (debug)
 				cprintf("file_create failed: %e", r);
-			return r;
+			goto fail;
 		}
 	} else {
 try_open:
 		if ((r = file_open(path, &f)) < 0) {
 			if (debug)
 				cprintf("file_open failed: %e", r);
-			return r;
+			goto fail;
 		}
 	}
 
@@ -149,20 +233,27 @@ try_open:
 		if ((r = file_set_size(f, 0)) < 0) {
 			if (debug)
 				cprintf("file_set_size failed: %e", r);
-			return r;
+			goto fail;
 		}
 	}
+	if (req->req_omode & (O_CREAT|O_TRUNC))
+		file_changed(f);
 	if ((r = file_open(path, &f)) < 0) {
 		if (debug)
 			cprintf("file_open failed: %e", r);
-		return r;
+		goto fail;
 	}
 
 	// Save the file pointer
 	o->o_file = f;
+	o->o_ra_pos = 0;
+	o->o_ra_win = 0;
+	o->o_ra_next = 0;
 
 	// Fill out the Fd structure
 	o->o_fd->fd_file.id = o->o_fileid;
+	// directories change as the files in them do, they aren't cached
+	o->o_fd->fd_file.inum = f->f_type == FTYPE_DIR ? 0 : file_inum(f);
 	o->o_fd->fd_omode = req->req_omode & O_ACCMODE;
 	o->o_fd->fd_dev_id = devfile.dev_id;
 	o->o_mode = req->req_omode;
@@ -176,6 +267,10 @@ try_open:
 	*perm_store = PTE_P|PTE_U|PTE_W|PTE_SHARE;
 
 	return 0;
+
+fail:
+	openfile_free(o);
+	return r;
 }
 
 // Set the size of req->req_fileid to req->req_size bytes, truncating
@@ -199,9 +294,36 @@ serve_set_size(envid_t envid, struct Fsreq_set_size *req)
 
 	// Second, call the relevant file system function (from fs/fs.c).
 	// On failure, return the error code to the client.
+	file_changed(o->o_file);
 	return file_set_size(o->o_file, req->req_size);
 }
 
+// Called before reading n bytes at offset from o.  A read that starts
+// where the last one ended grows the read-ahead window, up to RA_MAX
+// blocks; any other read turns read-ahead off.  Once the reads come
+// within half a window of the blocks fetched ahead, the next window's
+// worth is fetched.
+static void
+serve_readahead(struct OpenFile *o, off_t offset, size_t n)
+{
+	uint32_t next = (offset + n + BLKSIZE - 1) / BLKSIZE;
+
+	if (offset == o->o_ra_pos)
+		o->o_ra_win = o->o_ra_win ? MIN(o->o_ra_win * 2, RA_MAX) : RA_MIN;
+	else {
+		o->o_ra_win = 0;
+		o->o_ra_next = 0;
+	}
+	o->o_ra_pos = offset + n;
+
+	if (o->o_ra_win == 0 || next + o->o_ra_win / 2 < o->o_ra_next)
+		return;
+	next = MAX(next, o->o_ra_next);
+	o->o_ra_next = (offset + n + BLKSIZE - 1) / BLKSIZE + o->o_ra_win;
+	if (next < o->o_ra_next)
+		file_prefetch(o->o_file, next, o->o_ra_next - next);
+}
+
 // Read at most ipc->read.req_n bytes from the current seek position
 // in ipc->read.req_fileid.  Return the bytes read from the file to
 // the caller in ipc->readRet, then update the seek position.  Returns
@@ -220,7 +342,8 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	struct OpenFile *o;
 	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
-	
+
+	serve_readahead(o, o->o_fd->fd_offset, MIN(req->req_n, PGSIZE));
 	if ((r = file_read(o->o_file, ret->ret_buf, req->req_n, o->o_fd->fd_offset)) < 0)
 		return r;
 
@@ -228,6 +351,105 @@ serve_read(envid_t envid, union Fsipc *ipc)
 	return r;
 }
 
+// Like serve_read, but if the seek position is block aligned and at
+// least a whole block of the file is left, share that block from the
+// block cache with the caller copy-on-write instead of copying it.
+// In that case the page and its permissions are returned in *pg_store
+// and *perm_store, and BLKSIZE is returned.
+int
+serve_read_map(envid_t envid, union Fsipc *ipc, void **pg_store, int *perm_store)
+{
+	struct Fsreq_read_map *req = &ipc->read_map;
+	struct OpenFile *o;
+	char *blk;
+	off_t off;
+	int r;
+
+	if (debug)
+		cprintf("serve_read_map %08x %08x %08x\n", envid, req->req_fileid, req->req_n);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+
+	off = o->o_fd->fd_offset;
+	if (req->req_n < BLKSIZE || off % BLKSIZE || off + BLKSIZE > o->o_file->f_size) {
+		ipc->read.req_n = MIN(req->req_n, PGSIZE);
+		return serve_read(envid, ipc);
+	}
+
+	serve_readahead(o, off, BLKSIZE);
+	if ((r = file_get_block(o->o_file, off / BLKSIZE, &blk)) < 0)
+		return r;
+	share_block(blk);
+	o->o_fd->fd_offset += BLKSIZE;
+
+	*pg_store = blk;
+	*perm_store = PTE_P|PTE_U|PTE_COW;
+	return BLKSIZE;
+}
+
+// Map the block of req->req_fileid holding req->req_offset, which must
+// be block aligned and inside the file, into the caller: shared
+// read-only, or copy-on-write if req->req_cow.  Any part of the block
+// past the end of the file reads as zeros.  Where the block has other
+// bytes there, and for inline files, which have no block, the caller
+// gets a copy instead, so that mapping changes nothing on disk.
+int
+serve_map(envid_t envid, struct Fsreq_map *req, void **pg_store, int *perm_store)
+{
+	struct OpenFile *o;
+	struct File *f;
+	char *blk, *src, *copy = (char *) COPYVA;
+	off_t n;
+	int r;
+
+	if (debug)
+		cprintf("serve_map %08x %08x %08x\n", envid, req->req_fileid, req->req_offset);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if (req->req_offset < 0 || req->req_offset % BLKSIZE
+	    || req->req_offset >= o->o_file->f_size)
+		return -E_INVAL;
+	f = o->o_file;
+
+	// Versions must cover every way to see or change the file besides
+	// the requests that bump them: a shared mapping moves the version
+	// when it is handed out and again when it is flushed, so client
+	// caches never outlive one.
+	if (!req->req_cow) {
+		file_changed(f);
+		o->o_shared = 1;
+	}
+
+	if (f->f_flags & FILE_INLINE) {
+		src = (char *) f->f_data;
+		n = f->f_size;
+	} else {
+		if ((r = file_get_block(f, req->req_offset / BLKSIZE, &blk)) < 0)
+			return r;
+		for (n = f->f_size - req->req_offset; n < BLKSIZE && !blk[n]; n++)
+			;
+		if (n >= BLKSIZE) {
+			*pg_store = blk;
+			if (req->req_cow) {
+				share_block(blk);
+				*perm_store = PTE_P|PTE_U|PTE_COW;
+			} else
+				*perm_store = PTE_P|PTE_U;
+			return 0;
+		}
+		src = blk;
+		n = f->f_size - req->req_offset;
+	}
+
+	if ((r = sys_page_alloc(0, copy, PTE_P|PTE_U|PTE_W)) < 0)
+		return r;
+	memmove(copy, src, n);
+	*pg_store = copy;
+	*perm_store = req->req_cow ? PTE_P|PTE_U|PTE_COW : PTE_P|PTE_U;
+	return 0;
+}
 
 // Write req->req_n bytes from req->req_buf to req_fileid, starting at
 // the current seek position, and update the seek position
@@ -245,6 +467,7 @@ serve_write(envid_t envid, struct Fsreq_write *req)
 	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
 	
+	file_changed(o->o_file);
 	if ((r = file_write(o->o_file, req->req_buf, req->req_n, o->o_fd->fd_offset)) < 0)
 		return r;
 
@@ -252,6 +475,138 @@ serve_write(envid_t envid, struct Fsreq_write *req)
 	return r;
 }
 
+// Start fetching all the blocks holding n bytes of f at off at once,
+// so that the disk sees them as a few commands rather than a fault at
+// a time.
+static void
+serve_prefetch(struct File *f, off_t off, size_t n)
+{
+	if (n > 0)
+		file_prefetch(f, off / BLKSIZE,
+			      (off % BLKSIZE + n + BLKSIZE - 1) / BLKSIZE);
+}
+
+// Read or write ipc->pages.req_n bytes of req_fileid at the current
+// seek position directly from or into the 'ndata' pages the caller
+// sent after the request page, and update the seek position.  Returns
+// the number of bytes moved, or < 0 on error.
+static int
+serve_pages(envid_t envid, uint32_t req, union Fsipc *ipc, size_t ndata,
+	    int perm)
+{
+	struct Fsreq_pages *rq = &ipc->pages;
+	char *data = (char *) ipc + PGSIZE;
+	struct OpenFile *o;
+	off_t off;
+	size_t n;
+	int r;
+
+	if (debug)
+		cprintf("serve_pages %08x %d %08x %08x\n", envid, req,
+			rq->req_fileid, rq->req_n);
+
+	if ((r = openfile_lookup(envid, rq->req_fileid, &o)) < 0)
+		return r;
+	off = o->o_fd->fd_offset;
+	n = MIN(rq->req_n, ndata * PGSIZE);
+
+	if (req == FSREQ_READ_PAGES) {
+		if (!(perm & PTE_W))
+			return -E_INVAL;
+		serve_readahead(o, off, n);
+		serve_prefetch(o->o_file, off, n);
+		r = file_read(o->o_file, data, n, off);
+	} else {
+		file_changed(o->o_file);
+		r = file_write(o->o_file, data, n, off);
+	}
+	if (r < 0)
+		return r;
+
+	o->o_fd->fd_offset += r;
+	return r;
+}
+
+// Run the operations of a compound request on the file at
+// req_path, without giving the caller an open file: the file is only
+// open for the length of the request.  Data read is packed one read
+// after another into the 'ndata' pages after the request page, or
+// into ret_buf if there are none.  Returns 0, or the error of the
+// first operation that failed, which ends the request.
+static int
+serve_compound(envid_t envid, union Fsipc *ipc, size_t ndata, int perm)
+{
+	// the results overwrite the request
+	static struct Fsreq_compound rq;
+	struct Fsret_compound *ret = &ipc->compoundRet;
+	struct File *f = NULL;
+	struct Fsop *op;
+	char *data = ret->ret_buf;
+	size_t room = sizeof(ret->ret_buf), n;
+	off_t pos = 0;
+	int i, r = 0;
+
+	rq = ipc->compound;
+	rq.req_path[MAXPATHLEN-1] = 0;
+	if (rq.req_nops < 0 || rq.req_nops > FSOP_MAX)
+		return -E_INVAL;
+	if (ndata) {
+		if (!(perm & PTE_W))
+			return -E_INVAL;
+		data = (char *) ipc + PGSIZE;
+		room = ndata * PGSIZE;
+	}
+
+	if (debug)
+		cprintf("serve_compound %08x %s %d ops\n", envid, rq.req_path,
+			rq.req_nops);
+
+	memset(ret, 0, offsetof(struct Fsret_compound, ret_buf));
+	for (i = 0; i < rq.req_nops && r >= 0; i++) {
+		op = &rq.req_ops[i];
+		if (op->op != FSOP_OPEN && f == NULL)
+			r = -E_INVAL;
+		else if (op->op == FSOP_OPEN) {
+			r = file_open(rq.req_path, &f);
+			pos = 0;
+		} else if (op->op == FSOP_STAT) {
+			ret->ret_size = f->f_size;
+			ret->ret_isdir = (f->f_type == FTYPE_DIR);
+			r = 0;
+		} else if (op->op == FSOP_SEEK) {
+			if (op->arg > MAXFILESIZE)
+				r = -E_INVAL;
+			else {
+				pos = op->arg;
+				r = 0;
+			}
+		} else if (op->op == FSOP_READ) {
+			n = MIN(op->arg, room);
+			serve_prefetch(f, pos, n);
+			if ((r = file_read(f, data, n, pos)) > 0) {
+				data += r;
+				room -= r;
+				pos += r;
+			}
+		} else if (op->op == FSOP_CLOSE) {
+			f = NULL;
+			r = 0;
+		} else
+			r = -E_INVAL;
+		ret->ret_r[i] = r;
+	}
+	return MIN(r, 0);
+}
+
+// Share the page of file versions with the caller, read-only.
+static int
+serve_versions(envid_t envid, void **pg_store, int *perm_store)
+{
+	*pg_store = fvers;
+	*perm_store = PTE_P|PTE_U|PTE_SHARE;
+	return 0;
+}
+
 // Stat ipc->stat.req_fileid.  Return the file's struct Stat to the
 // caller in ipc->statRet.
 int
@@ -274,7 +629,8 @@ serve_stat(envid_t envid, union Fsipc *ipc)
 	return 0;
 }
 
-// Flush all data and metadata of req->req_fileid to disk.
+// Flush all data and metadata of req->req_fileid to disk.  Clients
+// close files this way, too.
 int
 serve_flush(envid_t envid, struct Fsreq_flush *req)
 {
@@ -287,6 +643,14 @@ serve_flush(envid_t envid, struct Fsreq_flush *req)
 	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
 	file_flush(o->o_file);
+	if (o->o_shared) {
+		file_changed(o->o_file);
+		o->o_shared = 0;
+	}
+	// if the caller holds the last reference to the Fd page besides
+	// ours, it is closing the file: the slot is free once it unmaps it
+	if (pageref(o->o_fd) == 2)
+		openfile_free(o);
 	return 0;
 }
 
@@ -298,6 +662,25 @@ serve_sync(envid_t envid, union Fsipc *req)
 	return 0;
 }
 
+// Return the block cache statistics in the request page.
+int
+serve_bcstat(envid_t envid, union Fsipc *ipc)
+{
+	memmove(ipc, &bc_stats, sizeof(bc_stats));
+	return 0;
+}
+
+// Serve a directory from RAM (see tmpfs.c).
+int
+serve_tmpfs(envid_t envid, union Fsipc *ipc)
+{
+	if (debug)
+		cprintf("serve_tmpfs %08x %s\n", envid, ipc->tmpfs.req_path);
+
+	ipc->tmpfs.req_path[MAXPATHLEN-1] = 0;
+	return tmpfs_mount(ipc->tmpfs.req_path);
+}
+
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
@@ -308,51 +691,214 @@ fshandler handlers[] = {
 	[FSREQ_FLUSH] =		(fshandler)serve_flush,
 	[FSREQ_WRITE] =		(fshandler)serve_write,
 	[FSREQ_SET_SIZE] =	(fshandler)serve_set_size,
-	[FSREQ_SYNC] =		serve_sync
+	[FSREQ_SYNC] =		serve_sync,
+	[FSREQ_BCSTAT] =	serve_bcstat,
+	[FSREQ_TMPFS] =		serve_tmpfs
 };
 
+// Start reading any file data request 'req' is about to read that
+// isn't in the block cache.  Returns how many blocks the disk has yet
+// to deliver: if that's not 0, the request is better set aside than
+// served now, which would hold up the server while the blocks are read
+// one at a time.  Only file data is read ahead like this.  Metadata,
+// and blocks evicted again before the request is served, are still
+// read when the handler faults on them.
+static int
+serve_fetch(envid_t envid, uint32_t req, union Fsipc *ipc)
+{
+	struct OpenFile *o;
+	off_t off;
+	size_t n;
+
+	if (req == FSREQ_READ || req == FSREQ_READ_MAP) {
+		if (openfile_lookup(envid, ipc->read.req_fileid, &o) < 0)
+			return 0;
+		off = o->o_fd->fd_offset;
+		n = MIN(ipc->read.req_n, PGSIZE);
+	} else if (req == FSREQ_MAP) {
+		if (openfile_lookup(envid, ipc->map.req_fileid, &o) < 0
+		    || ipc->map.req_offset < 0)
+			return 0;
+		off = ipc->map.req_offset;
+		n = BLKSIZE;
+	} else
+		return 0;
+
+	if (off < 0 || off >= o->o_file->f_size || n == 0)
+		return 0;
+	n = MIN(n, o->o_file->f_size - off);
+	return file_prefetch(o->o_file, off / BLKSIZE,
+			     (off + n - 1) / BLKSIZE - off / BLKSIZE + 1);
+}
+
+// Serve request 'req' from whom, whose argument page is at ipc,
+// followed by 'ndata' more pages, and reply.
+static void
+serve_request(envid_t whom, uint32_t req, union Fsipc *ipc, size_t ndata,
+	      int reqperm)
+{
+	int perm = 0, r;
+	void *pg = NULL;
+	size_t i;
+
+	if (req == FSREQ_OPEN) {
+		r = serve_open(whom, (struct Fsreq_open*)ipc, &pg, &perm);
+	} else if (req == FSREQ_READ_MAP) {
+		r = serve_read_map(whom, ipc, &pg, &perm);
+	} else if (req == FSREQ_MAP) {
+		r = serve_map(whom, &ipc->map, &pg, &perm);
+	} else if (req == FSREQ_READ_PAGES || req == FSREQ_WRITE_PAGES) {
+		r = serve_pages(whom, req, ipc, ndata, reqperm);
+	} else if (req == FSREQ_COMPOUND) {
+		r = serve_compound(whom, ipc, ndata, reqperm);
+	} else if (req == FSREQ_VERSIONS) {
+		r = serve_versions(whom, &pg, &perm);
+	} else if (req < ARRAY_SIZE(handlers) && handlers[req]) {
+		r = handlers[req](whom, ipc);
+	} else {
+		cprintf("Invalid request code %d from %08x\n", req, whom);
+		r = -E_INVAL;
+	}
+	if (WB_MAXAGE == 0)
+		journal_commit();
+	ipc_send(whom, r, pg, perm);
+	if (pg == (void *) COPYVA)
+		sys_page_unmap(0, pg);
+	for (i = 0; i <= ndata; i++)
+		sys_page_unmap(0, (char *) ipc + i * PGSIZE);
+}
+
+// Set the request in fsreq aside.  Returns < 0 if there's no room.
+static int
+serve_park(envid_t whom, uint32_t req, int perm)
+{
+	union Fsipc *pg;
+	int i, r;
+
+	for (i = 0; i < NPARK && parked[i].p_whom; i++)
+		;
+	if (i == NPARK)
+		return -E_NO_MEM;
+	pg = (union Fsipc *) (PARKVA + i * PGSIZE);
+	if ((r = sys_page_map(0, fsreq, 0, pg, perm & PTE_SYSCALL)) < 0)
+		return r;
+	sys_page_unmap(0, fsreq);
+	parked[i].p_whom = whom;
+	parked[i].p_req = req;
+	parked[i].p_perm = perm;
+	parked[i].p_tries = 0;
+	return 0;
+}
+
+// Put finished reads in the block cache, and serve the requests set
+// aside that now have their data.
+static void
+serve_parked(void)
+{
+	union Fsipc *pg;
+	int i, reaped;
+
+	reaped = bc_reap();
+	for (i = 0; i < NPARK; i++) {
+		if (!parked[i].p_whom)
+			continue;
+		pg = (union Fsipc *) (PARKVA + i * PGSIZE);
+		if (reaped)
+			parked[i].p_tries++;
+		if (parked[i].p_tries < PARK_TRIES
+		    && serve_fetch(parked[i].p_whom, parked[i].p_req, pg) > 0)
+			continue;
+		serve_request(parked[i].p_whom, parked[i].p_req, pg, 0,
+			      parked[i].p_perm);
+		parked[i].p_whom = 0;
+	}
+}
+
+// The server loop.  Requests are served one at a time, but one that
+// would wait for the disk to read its file data is set aside until
+// the data is in, and the requests behind it are served meanwhile.
+// Requests with data pages are not set aside; they fetch all their
+// blocks with as few commands as they can instead (see serve_pages).
+// The disk reports finishing a command with an IPC from envid 0 (see
+// ios_intr).
 void
 serve(void)
 {
 	uint32_t req, whom;
-	int perm, r;
-	void *pg;
+	size_t npages;
+	int perm;
 
 	while (1) {
 		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
+		npages = 1 + FSIPC_MAXPAGES;
+		req = ipc_recv_pages((int32_t *) &whom, fsreq, &npages, &perm);
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], fsreq);
 
-		// All requests must contain an argument page
+		if (whom == 0) {
+			ios_intr();
+			serve_parked();
+			continue;
+		}
+
+		// the write-back timer's tick carries no page and wants no reply
+		if (req == FSREQ_WRITEBACK && whom == wb_envid) {
+			fs_sync();
+			serve_parked();
+			continue;
+		}
+
+		// All other requests must contain an argument page
 		if (!(perm & PTE_P)) {
 			cprintf("Invalid request from %08x: no argument page\n",
 				whom);
 			continue; // just leave it hanging...
 		}
 
-		pg = NULL;
-		if (req == FSREQ_OPEN) {
-			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
-		} else if (req < ARRAY_SIZE(handlers) && handlers[req]) {
-			r = handlers[req](whom, fsreq);
-		} else {
-			cprintf("Invalid request code %d from %08x\n", req, whom);
-			r = -E_INVAL;
-		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		if (npages == 1 && serve_fetch(whom, req, fsreq) > 0
+		    && serve_park(whom, req, perm) == 0)
+			continue;
+		serve_request(whom, req, fsreq, npages - 1, perm);
+		// reads may have finished while it had the disk
+		serve_parked();
+	}
+}
+
+// Body of the write-back timer environment: every WB_MAXAGE msec,
+// tell the fs server to write out its dirty blocks.
+static void
+wb_timer(envid_t fs_envid)
+{
+	binaryname = "fs_wb";
+
+	// asleep in between, so an otherwise idle CPU really idles
+	while (1) {
+		sys_sleep(WB_MAXAGE);
+		ipc_send(fs_envid, FSREQ_WRITEBACK, 0, 0);
 	}
 }
 
 void
 umain(int argc, char **argv)
 {
+	envid_t fs_envid = sys_getenvid();
+
 	static_assert(sizeof(struct File) == 256);
 	binaryname = "fs";
 	cprintf("FS is running\n");
 
+	// Fork off the write-back timer while there's no block cache
+	// for the child to inherit.
+	if (WB_MAXAGE) {
+		if ((wb_envid = fork()) < 0)
+			panic("fork write-back timer: %e", wb_envid);
+		if (wb_envid == 0) {
+			wb_timer(fs_envid);
+			return;
+		}
+	}
+
 	// Check that we are able to do I/O
 	outw(0x8A00, 0x8A00);
 	cprintf("FS can do I/O\n");
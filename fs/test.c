@@ -49,7 +49,7 @@ fs_test(void)
 
 	if ((r = file_set_size(f, 0)) < 0)
 		panic("file_set_size: %e", r);
-	assert(f->f_direct[0] == 0);
+	assert(f->f_direct[0] == 0 && f->f_nextent == 0);
 	assert(!(uvpt[PGNUM(f)] & PTE_D));
 	cprintf("file_truncate is good\n");
 
@@ -65,3 +65,66 @@ fs_test(void)
 	assert(!(uvpt[PGNUM(f)] & PTE_D));
 	cprintf("file rewrite is good\n");
 }
+
+// Disk throughput: reading the disk from the start with the longest
+// commands, and reading single blocks all over it, one at a time and
+// many queued at once, which the I/O scheduler sorts.  Run at startup
+// with 'make IDE_BENCH=1', and 'make IDE_PIO=1' to compare with PIO.
+#define BENCH_SEQ	1024	// blocks read sequentially
+#define BENCH_RAND	256	// blocks read at random
+
+#define BENCH_DEPTH	(sizeof(bench_buf) / BLKSIZE)
+
+static uint8_t bench_buf[256 * SECTSIZE] __attribute__((aligned(PGSIZE)));
+static struct IoReq bench_req[BENCH_DEPTH];
+
+void
+ide_bench(void)
+{
+	uint32_t nblocks = super->s_nblocks, seed = 1, i, n, t;
+	struct BcStats st = bc_stats;
+
+	// the disk can only read into pages that are there
+	memset(bench_buf, 0, sizeof(bench_buf));
+
+	n = MIN(BENCH_SEQ, nblocks);
+	t = sys_time_msec();
+	for (i = 0; i < n; i += sizeof(bench_buf) / BLKSIZE)
+		ide_read(i * BLKSECTS, bench_buf,
+			 MIN(sizeof(bench_buf) / BLKSIZE, n - i) * BLKSECTS);
+	t = MAX(sys_time_msec() - t, 1);
+	cprintf("ide bench: sequential %d blocks in %d msec, %d KB/s\n",
+		n, t, n * (BLKSIZE / 1024) * 1000 / t);
+
+	t = sys_time_msec();
+	for (i = 0; i < BENCH_RAND; i++) {
+		seed = seed * 1103515245 + 12345;
+		ide_read((seed >> 8) % nblocks * BLKSECTS, bench_buf, BLKSECTS);
+	}
+	t = MAX(sys_time_msec() - t, 1);
+	cprintf("ide bench: random %d blocks in %d msec, %d KB/s\n",
+		BENCH_RAND, t, BENCH_RAND * (BLKSIZE / 1024) * 1000 / t);
+
+	// the same, but as many at once as bench_buf has room for
+	t = sys_time_msec();
+	for (i = 0; i < BENCH_RAND; i += BENCH_DEPTH) {
+		for (n = 0; n < BENCH_DEPTH; n++) {
+			seed = seed * 1103515245 + 12345;
+			bench_req[n].blockno = (seed >> 8) % nblocks;
+			bench_req[n].nblocks = 1;
+			bench_req[n].va = (char *) bench_buf + n * BLKSIZE;
+			bench_req[n].flags = 0;
+			ios_submit(&bench_req[n]);
+		}
+		for (n = 0; n < BENCH_DEPTH; n++)
+			ios_wait(&bench_req[n]);
+	}
+	t = MAX(sys_time_msec() - t, 1);
+	cprintf("ide bench: random %d blocks, %d at a time, in %d msec, %d KB/s\n",
+		BENCH_RAND, BENCH_DEPTH, t, BENCH_RAND * (BLKSIZE / 1024) * 1000 / t);
+	n = bc_stats.io_reads - st.io_reads;
+	cprintf("ide bench: %d commands, reads took %d msec on average, %d at most\n",
+		bc_stats.io_cmds - st.io_cmds,
+		(bc_stats.io_read_msec - st.io_read_msec) / MAX(n, 1),
+		bc_stats.io_read_max);
+}
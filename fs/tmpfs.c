@@ -0,0 +1,147 @@
+/*
+ * tmpfs: a directory subtree kept in RAM.
+ *
+ * tmpfs_mount(path) covers the directory at path with the root of a
+ * file system whose blocks are numbers [TMPFS_BASE, TMPFS_BASE +
+ * TMPFS_BLOCKS), past the end of any disk, which a RAM disk holds (see
+ * ramdisk.c).  Otherwise they are ordinary blocks -- cached at
+ * diskaddr(), evicted to the RAM disk and faulted back in -- except
+ * that
+ *
+ *  - they are allocated from tmpfs_bitmap, not the disk's bitmap.  A
+ *    new block is a tmpfs block if what will point to it is in one
+ *    (see tmpfs_goal);
+ *  - they are neither journaled nor written back (see flush_meta and
+ *    bc_sync), as nothing in them needs to survive a crash.
+ *
+ * The first block holds the root directory's File, which walk_path
+ * steps to from the mount point (tmpfs_cover).  Nothing on the disk
+ * points into the tmpfs, so after a reboot the mount point is the
+ * empty directory it was.
+ */
+
+#include "fs.h"
+
+#define TMPFS_BLOCKS	4096			// 16MB
+#define TMPFS_BASE	(DISKSIZE / BLKSIZE - TMPFS_BLOCKS)
+
+#define tmpfs_root	((struct File *) (DISKMAP + TMPFS_BASE * BLKSIZE))
+
+static struct File *tmpfs_mountpoint;	// NULL if there is no tmpfs
+static uint32_t tmpfs_bitmap[TMPFS_BLOCKS / 32];	// 1 means free
+static uint32_t tmpfs_cursor;		// next fit, as alloc_cursor
+
+// Is 'blockno' a block of the tmpfs?
+bool
+tmpfs_block(uint32_t blockno)
+{
+	return tmpfs_mountpoint && blockno >= TMPFS_BASE
+		&& blockno - TMPFS_BASE < TMPFS_BLOCKS;
+}
+
+// Is 'goal', a block to allocate near (see find_block), in the tmpfs?
+// Goals just past its last block are.
+bool
+tmpfs_near(uint32_t goal)
+{
+	return tmpfs_mountpoint && goal >= TMPFS_BASE;
+}
+
+bool
+tmpfs_is_free(uint32_t blockno)
+{
+	blockno -= TMPFS_BASE;
+	return (tmpfs_bitmap[blockno / 32] & (1 << (blockno % 32))) != 0;
+}
+
+// Find a free tmpfs block: 'goal' if it is free, otherwise the next
+// one after it, wrapping around.  Returns 0 if the tmpfs is full.
+uint32_t
+tmpfs_find(uint32_t goal)
+{
+	uint32_t i, n;
+
+	i = (goal - TMPFS_BASE) % TMPFS_BLOCKS;
+	for (n = 0; n < TMPFS_BLOCKS; n++, i = (i + 1) % TMPFS_BLOCKS)
+		if (tmpfs_bitmap[i / 32] & (1 << (i % 32)))
+			return TMPFS_BASE + i;
+	return 0;
+}
+
+void
+tmpfs_take(uint32_t blockno)
+{
+	tmpfs_cursor = blockno + 1 < TMPFS_BASE + TMPFS_BLOCKS ? blockno + 1
+		: TMPFS_BASE;
+	blockno -= TMPFS_BASE;
+	tmpfs_bitmap[blockno / 32] &= ~(1 << (blockno % 32));
+}
+
+void
+tmpfs_free(uint32_t blockno)
+{
+	ramdisk_discard(blockno);
+	blockno -= TMPFS_BASE;
+	tmpfs_bitmap[blockno / 32] |= 1 << (blockno % 32);
+}
+
+// The goal for allocating a block that 'owner', a File or a block
+// pointer, will point to: in the tmpfs if owner is, else 0.
+uint32_t
+tmpfs_goal(void *owner)
+{
+	if ((uintptr_t) owner < DISKMAP
+	    || !tmpfs_block(((uintptr_t) owner - DISKMAP) / BLKSIZE))
+		return 0;
+	return tmpfs_cursor;
+}
+
+// The file walk_path should go on with after finding f.
+struct File *
+tmpfs_cover(struct File *f)
+{
+	return f == tmpfs_mountpoint ? tmpfs_root : f;
+}
+
+// Serve the directory at path, made if there is none, from an empty
+// tmpfs.  There can be one tmpfs.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if there is a tmpfs already, or path is the root
+//		or isn't a directory.
+//	-E_NO_DISK if the disk reaches into the tmpfs's block numbers.
+//	-E_NO_MEM if the RAM disk has no room for it.
+//	Errors from file_create.
+int
+tmpfs_mount(const char *path)
+{
+	struct File *f;
+	int r;
+
+	if (tmpfs_mountpoint)
+		return -E_INVAL;
+	if (super->s_nblocks >= TMPFS_BASE)
+		return -E_NO_DISK;
+	if ((r = file_open(path, &f)) == -E_NOT_FOUND) {
+		if ((r = file_create(path, &f)) < 0)
+			return r;
+		f->f_type = FTYPE_DIR;
+		f->f_flags = 0;
+		flush_meta(f);
+	}
+	if (r < 0)
+		return r;
+	if (f->f_type != FTYPE_DIR || f == &super->s_root)
+		return -E_INVAL;
+	if ((r = ramdisk_attach(TMPFS_BASE, TMPFS_BLOCKS)) < 0)
+		return r;
+
+	memset(tmpfs_bitmap, 0xFF, sizeof(tmpfs_bitmap));
+	tmpfs_mountpoint = f;
+	tmpfs_take(TMPFS_BASE);
+	memset(tmpfs_root, 0, BLKSIZE);
+	strcpy(tmpfs_root->f_name, f->f_name);
+	tmpfs_root->f_type = FTYPE_DIR;
+	cprintf("tmpfs: %s, %d blocks\n", path, TMPFS_BLOCKS);
+	return 0;
+}
@@ -29,6 +29,9 @@ typedef int32_t envid_t;
 #define NENV			(1 << LOG2NENV)
 #define ENVX(envid)		((envid) & (NENV - 1))
 
+// Most pages one IPC can carry (see sys_ipc_try_send)
+#define IPC_MAXPAGES		64
+
 // Values of env_status in struct Env
 enum {
 	ENV_FREE = 0,
@@ -37,7 +40,8 @@ enum {
 	ENV_RUNNING,
 	ENV_NOT_RUNNABLE,
 	ENV_IDE_SLEEPING,
-	ENV_NS_WAITING
+	ENV_NS_WAITING,
+	ENV_SLEEPING
 };
 
 // Special environment types
@@ -69,10 +73,17 @@ struct Env {
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	size_t env_ipc_maxpages;	// Most pages to map at env_ipc_dstva
+	size_t env_ipc_npages;		// Number of pages received
 
 	// Lab 5 FS
 	void *chan;				// sleep on channel (0 means write, otherwise read)
-	int op;				// read 0, write 1
+	int op;				// read 0, write 1, no data 2
+	size_t nsecs;			// sectors left to transfer, a page per IRQ
+	bool ide_async;			// an IDE_ASYNC command is in progress
+	bool ide_done;			// an IDE_ASYNC command finished unnoticed
+
+	uint32_t env_wakeup;		// ENV_SLEEPING until this time_msec()
 };
 
 #endif // !JOS_INC_ENV_H
@@ -25,6 +25,7 @@ struct Dev {
 
 struct FdFile {
 	int id;
+	uint32_t inum;		// file number for caching it, 0 not to
 };
 
 struct FdSock {
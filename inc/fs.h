@@ -24,21 +24,50 @@
 // Number of direct block pointers in an indirect block
 #define NINDIRECT	(BLKSIZE / 4)
 
-#define MAXFILESIZE	((NDIRECT + NINDIRECT) * BLKSIZE)
+// Number of extents in a File descriptor
+#define NEXTENT		6
+
+// Blocks reachable through the direct, indirect and double-indirect
+// pointers (4GB worth)
+#define MAXFILEBLKS	(NDIRECT + NINDIRECT + NINDIRECT * NINDIRECT)
+// off_t runs out before the block pointers do
+#define MAXFILESIZE	0x7FFFF000
+// Files up to this size can keep their contents in their File, in
+// place of the block pointers and extents.  Must do arithmetic in case
+// we're compiling fsformat on a 64-bit machine.
+#define MAXINLINESIZE	(256 - MAXNAMELEN - 8 - 4)
+
+// A run of e_len consecutive disk blocks starting at e_start
+struct Extent {
+	uint32_t e_start;
+	uint32_t e_len;
+};
 
 struct File {
 	char f_name[MAXNAMELEN];	// filename
 	off_t f_size;			// file size in bytes
 	uint32_t f_type;		// file type
 
-	// Block pointers.
-	// A block is allocated iff its value is != 0.
-	uint32_t f_direct[NDIRECT];	// direct blocks
-	uint32_t f_indirect;		// indirect block
+	union {
+		struct {
+			// Block pointers.
+			// A block is allocated iff its value is != 0.
+			uint32_t f_direct[NDIRECT];	// direct blocks
+			uint32_t f_indirect;		// indirect block
+			uint32_t f_dindirect;		// double-indirect block
+			uint32_t f_dirhash;		// directories: hashed index, or 0
 
-	// Pad out to 256 bytes; must do arithmetic in case we're compiling
-	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4];
+			// Extents.  The first blocks of the file are the runs
+			// f_extent[0] .. f_extent[f_nextent - 1], in order; the
+			// block pointers only map the blocks after those.
+			uint32_t f_nextent;
+			struct Extent f_extent[NEXTENT];
+		};
+		// FILE_INLINE files: the contents, instead of any blocks.
+		// Also pads the File out to 256 bytes.
+		uint8_t f_data[MAXINLINESIZE];
+	};
+	uint32_t f_flags;		// FILE_*
 } __attribute__((packed));	// required only on some 64-bit machines
 
 // An inode block contains exactly BLKFILES 'struct File's
@@ -48,6 +77,16 @@ struct File {
 #define FTYPE_REG	0	// Regular file
 #define FTYPE_DIR	1	// Directory
 
+// File flags
+#define FILE_INLINE	0x1	// contents are in f_data, no blocks
+
+
+// Block holding a directory's hashed index, see fs/fs.c
+struct DirHash {
+	uint32_t dh_count;		// entries in the table
+	uint32_t dh_nblocks;		// table size in blocks, a power of 2
+	uint32_t dh_blocks[NINDIRECT - 2];	// the table's blocks
+};
 
 // File system super-block (both in-memory and on-disk)
 
@@ -57,6 +96,44 @@ struct Super {
 	uint32_t s_magic;		// Magic number: FS_MAGIC
 	uint32_t s_nblocks;		// Total number of blocks on disk
 	struct File s_root;		// Root directory node
+	uint32_t s_journal;		// First block of the journal region
+	uint32_t s_njournal;		// Its length in blocks, 0 if none
+};
+
+// Metadata journal, see fs/journal.c.  The journal region is a
+// header block followed by room for NJOURNAL logged blocks.
+
+#define JOURNAL_MAGIC	0x4A4C4F47	// 'JLOG'
+#define NJOURNAL	32		// most blocks one transaction logs
+
+struct JournalHeader {
+	uint32_t jh_magic;		// JOURNAL_MAGIC
+	uint32_t jh_seq;		// transaction number
+	uint32_t jh_nblocks;		// blocks logged after the header
+	uint32_t jh_blocks[NJOURNAL];	// where each one belongs
+	uint32_t jh_sum;		// checksum of all of the above
+};
+
+// Block cache statistics, see fs/bc.c, name cache statistics, see
+// fs/fs.c, and journal statistics, see fs/journal.c
+struct BcStats {
+	uint32_t bc_hits;		// block lookups that found it cached
+	uint32_t bc_misses;		// blocks read in from disk
+	uint32_t bc_evictions;		// blocks dropped to make room
+	uint32_t bc_prefetched;		// blocks read in ahead of use
+	uint32_t bc_writes;		// disk write commands issued
+	uint32_t bc_written;		// blocks written by them
+	uint32_t dc_hits;		// path components found in the name cache
+	uint32_t dc_misses;		// path components looked up in directories
+	uint32_t jn_commits;		// journal transactions committed
+	uint32_t jn_logged;		// blocks logged by them
+	uint32_t io_reads;		// disk reads, through the I/O scheduler
+	uint32_t io_writes;		// disk writes, likewise
+	uint32_t io_cmds;		// disk commands they were merged into
+	uint32_t io_read_msec;		// total msec from queueing a read to done
+	uint32_t io_read_max;		// the longest one
+	uint32_t io_write_msec;		// the same for writes
+	uint32_t io_write_max;
 };
 
 // Definitions for requests from clients to file system
@@ -70,8 +147,48 @@ enum {
 	FSREQ_STAT,
 	FSREQ_FLUSH,
 	FSREQ_REMOVE,
-	FSREQ_SYNC
+	FSREQ_SYNC,
+	// Read_map returns a whole block as a copy-on-write page
+	// when it can, otherwise a Fsret_read like Read
+	FSREQ_READ_MAP,
+	// Map returns the block at req_offset as a page, for mmap
+	FSREQ_MAP,
+	// Bcstat returns a struct BcStats on the request page
+	FSREQ_BCSTAT,
+	// Writeback is the fs server's own write-back timer tick, no page
+	FSREQ_WRITEBACK,
+	// Tmpfs serves the directory at req_path from RAM from now on
+	FSREQ_TMPFS,
+	// Read_pages and Write_pages move the data in the pages sent after
+	// the request page, up to FSIPC_MAXPAGES of them
+	FSREQ_READ_PAGES,
+	FSREQ_WRITE_PAGES,
+	// Compound runs req_ops in order on the file at req_path, and
+	// returns their results together in a Fsret_compound.  The data
+	// read lands in the pages sent after the request page, if any,
+	// otherwise in ret_buf.
+	FSREQ_COMPOUND,
+	// Versions returns the page of file versions, read-only and shared
+	FSREQ_VERSIONS
+};
+
+// A file's version, in the page FSREQ_VERSIONS returns, changes whenever
+// its contents or size do.  File number inum (struct FdFile) has version
+// inum % FS_NVERS, so some files share one.
+#define FS_NVERS	(PGSIZE / sizeof(uint32_t))
+
+// Operations of a compound request
+enum {
+	FSOP_OPEN = 1,		// look up req_path, read-only
+	FSOP_STAT,		// fill in ret_size and ret_isdir
+	FSOP_SEEK,		// move to offset 'arg'
+	FSOP_READ,		// read 'arg' bytes, or what room is left
+	FSOP_CLOSE
 };
+#define FSOP_MAX	8
+
+// Most data pages one Read_pages or Write_pages request carries
+#define FSIPC_MAXPAGES	32
 
 union Fsipc {
 	struct Fsreq_open {
@@ -108,6 +225,36 @@ union Fsipc {
 	struct Fsreq_remove {
 		char req_path[MAXPATHLEN];
 	} remove;
+	struct Fsreq_read_map {
+		int req_fileid;
+		size_t req_n;
+	} read_map;
+	struct Fsreq_map {
+		int req_fileid;
+		off_t req_offset;
+		int req_cow;		// copy-on-write rather than shared
+	} map;
+	struct Fsreq_tmpfs {
+		char req_path[MAXPATHLEN];
+	} tmpfs;
+	struct Fsreq_pages {
+		int req_fileid;
+		size_t req_n;
+	} pages;
+	struct Fsreq_compound {
+		char req_path[MAXPATHLEN];
+		int req_nops;
+		struct Fsop {
+			int op;
+			uint32_t arg;
+		} req_ops[FSOP_MAX];
+	} compound;
+	struct Fsret_compound {
+		int ret_r[FSOP_MAX];	// up to the first that failed
+		off_t ret_size;
+		int ret_isdir;
+		char ret_buf[PGSIZE - (FSOP_MAX + 2) * sizeof(int)];
+	} compoundRet;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
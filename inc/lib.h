@@ -57,10 +57,16 @@ int	sys_page_alloc(envid_t env, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
+int	sys_page_reserve(envid_t env, void *pg, size_t len, int perm);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_send_pages(envid_t to_env, uint32_t value, void *pg, int perm, size_t npages);
 int	sys_ipc_recv(void *rcv_pg);
+int	sys_ipc_recv_pages(void *rcv_pg, size_t npages);
 unsigned int sys_time_msec(void);
-void sys_ide_sleep(void *chan, size_t nsecs, int op);
+int	sys_sleep(unsigned int msec);
+int	sys_ide_sleep(void *chan, size_t nsecs, int op);
+int	sys_vblk_submit(uint32_t tag, uint32_t secno, void *va, size_t nsecs, int op);
+int	sys_vblk_reap(uint32_t *tags, int max);
 int sys_send(const void *buffer, size_t length);
 int sys_recv(void *buffer, size_t length);
 
@@ -78,12 +84,14 @@ sys_exofork(void)
 // ipc.c
 void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
+void	ipc_send_pages(envid_t to_env, uint32_t value, void *pg, int perm, size_t npages);
+int32_t ipc_recv_pages(envid_t *from_env_store, void *pg, size_t *npages, int *perm_store);
 envid_t	ipc_find_env(enum EnvType type);
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
 envid_t	sfork(void);	// Challenge!
+bool	cow_enable(void);
 
 // fd.c
 int	close(int fd);
@@ -101,6 +109,13 @@ int	open(const char *path, int mode);
 int	ftruncate(int fd, off_t size);
 int	remove(const char *path);
 int	sync(void);
+int	bcstat(struct BcStats *st);
+int	mount_tmpfs(const char *path);
+int	read_whole_file(const char *path, void *buf, size_t max);
+int	fcache_enable(void);
+void*	mmap(int fd, off_t offset, size_t len, int prot, int flags);
+int	munmap(void *addr, size_t len);
+int	mmap_pgfault(void *addr);
 
 // pageref.c
 int	pageref(void *addr);
@@ -152,4 +167,11 @@ void	wait(envid_t env);
 #define	O_EXCL		0x0400		/* error if already exists */
 #define O_MKDIR		0x0800		/* create directory, not regular file */
 
+/* mmap protections and flags */
+#define	PROT_READ	0x1		/* pages can be read */
+#define	PROT_WRITE	0x2		/* pages can be written */
+
+#define	MAP_SHARED	0x1		/* see the file's changes, read-only */
+#define	MAP_PRIVATE	0x2		/* changes are copy-on-write and private */
+
 #endif	// !JOS_INC_LIB_H
@@ -59,6 +59,9 @@
  *                     |      Normal User Stack       | RW/RW  PGSIZE
  *                     +------------------------------+ 0xeebfd000
  *                     |                              |
+ *                     ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+ *                     |   Shared libjos (optional)   | R-/R- text, RW/RW data
+ *    ULIB  -------->  +------------------------------+ 0xe0000000
  *                     |                              |
  *                     ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
  *                     .                              .
@@ -130,6 +133,11 @@
 // Where user programs generally begin
 #define UTEXT		(2*PTSIZE)
 
+// Where the shared libjos image is linked and mapped (see lib/libjos.ld).
+// The fs server is linked statically, so nothing is mapped here in it:
+// its RAM disk (fs/ramdisk.c) reuses the range up to 0xEE000000.
+#define ULIB		0xE0000000
+
 // Used for temporary page mappings.  Typed 'void*' for convenience
 #define UTEMP		((void*) PTSIZE)
 // Used for temporary page mappings for the user page-fault handler
@@ -188,6 +196,9 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// PP_* flags, see kern/pmap.h.
+	uint16_t pp_flags;
 };
 
 #endif /* !__ASSEMBLER__ */
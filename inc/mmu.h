@@ -70,9 +70,20 @@
 // including PTE_SHARE 0x400
 #define PTE_AVAIL	0xE00	// Available for software use
 
+// PTE_AVAIL bits given a meaning by the user library.  The kernel's
+// same-page merging (kern/ksm.c) has to honour them too.
+#define PTE_SHARE	0x400	// Shared with children by fork and spawn
+#define PTE_COW		0x800	// Copy-on-write (see lib/fork.c)
+
 // Flags in PTE_SYSCALL may be used in system calls.  (Others may not.)
 #define PTE_SYSCALL	(PTE_AVAIL | PTE_P | PTE_W | PTE_U)
 
+// A not-present PTE with PTE_DZ set is reserved demand-zero: the kernel
+// maps a zeroed page there, with the PTE's PTE_SYSCALL bits, the first
+// time it is touched.  The MMU ignores not-present PTEs, so the bit can
+// share its position with PTE_G.
+#define PTE_DZ		0x100
+
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)	((physaddr_t) (pte) & ~0xFFF) // purge tags
 
@@ -21,7 +21,17 @@ enum {
 	SYS_ide_sleep,
 	SYS_send,
 	SYS_recv,
+	SYS_page_reserve,
+	SYS_vblk_submit,
+	SYS_vblk_reap,
+	SYS_ipc_send_pages,
+	SYS_sleep,
 	NSYSCALLS
 };
 
+/* sys_ide_sleep ops besides read (0), write (1) and no data (2) */
+#define IDE_WAIT	3	// sleep until the IDE_ASYNC command is done
+#define IDE_ASYNC	0x10	// or'd in: return at once, see sys_ide_sleep
+#define IDE_IOV		0x20	// or'd in: va lists the command's pages
+
 #endif /* !JOS_INC_SYSCALL_H */
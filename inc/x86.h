@@ -9,6 +9,15 @@ breakpoint(void)
 	asm volatile("int3");
 }
 
+// Index of the lowest set bit of v, which must not be 0.
+static inline uint32_t
+bsf(uint32_t v)
+{
+	uint32_t r;
+	asm volatile("bsfl %1,%0" : "=r" (r) : "rm" (v));
+	return r;
+}
+
 static inline uint8_t
 inb(int port)
 {
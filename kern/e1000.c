@@ -91,6 +91,7 @@ struct tx_desc tdesc[64];  // TDESC ring buffer, max 64
 struct rx_desc rdesc[128]; // RDESC ring buffer, min 128
 
 volatile uint32_t *e1000_bar0;      // memory mapped E1000 device registers
+uint8_t e1000_irq;                  // its interrupt line, 0 if none attached
 
 static void init_tx()
 {
@@ -158,7 +159,8 @@ int pci_func_attach(struct pci_func *pcif)
     cprintf("Device status for E1000 BAR 0 is 0x%x\n",
 		e1000_bar0[E1000_STATUS]);
     // enable pci interrupts
-	irq_setmask_8259A(irq_mask_8259A & ~(1<<pcif->irq_line));
+	e1000_irq = pcif->irq_line;
+	irq_setmask_8259A(irq_mask_8259A & ~(1<<e1000_irq));
 
     init_tx();
     init_rx();
@@ -12,5 +12,7 @@ size_t e1000_transmit(const void *buffer, size_t size);
 size_t e1000_receive(void *buffer, size_t size);
 void e1000_intr();
 
+extern uint8_t e1000_irq;	// 0 if there's no e1000
+
 
 #endif  // SOL >= 6
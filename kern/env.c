@@ -238,6 +238,8 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	e->env_type = ENV_TYPE_USER;
 	e->env_status = ENV_RUNNABLE;
 	e->env_runs = 0;
+	e->ide_async = 0;
+	e->ide_done = 0;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -384,7 +386,12 @@ load_icode(struct Env *e, uint8_t *binary)
 	{
 		if (ph->p_type == ELF_PROG_LOAD && ph->p_filesz <= ph->p_memsz)
 		{
-			region_alloc(e, (void *)ph->p_va, ph->p_memsz);
+			// only the file-backed part needs frames now,
+			// the rest of the segment (.bss) is demand-zero
+			region_alloc(e, (void *)ph->p_va, ph->p_filesz);
+			for (uintptr_t va = ROUNDDOWN(ph->p_va, PGSIZE); va < ROUNDUP(ph->p_va + ph->p_memsz, PGSIZE); va += PGSIZE)
+				if (page_lookup(e->env_pgdir, (void *)va, NULL) == NULL && page_reserve(e->env_pgdir, (void *)va, PTE_P | PTE_U | PTE_W) != 0)
+					panic("page_reserve: %e", -E_NO_MEM);
 			lcr3(PADDR(e->env_pgdir));
 			memmove((void *)ph->p_va, (void*)(binary + ph->p_offset), ph->p_filesz);
 			lcr3(PADDR(kern_pgdir));
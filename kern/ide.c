@@ -0,0 +1,268 @@
+// The kernel's half of the IDE disk driver.
+//
+// The fs server sets up the drive's registers itself (fs/ide.c) and
+// asks sys_ide_sleep to start the command with ide_start().  If
+// kern/pci.c found a PIIX IDE function, its bus master moves the data
+// by DMA, straight between the drive and the fs server's pages, which
+// are listed in a PRD table; the drive interrupts once, at the end.
+// Otherwise the IDE interrupt moves the data with insl/outsl, a page
+// per interrupt, in the fs server's address space.
+//
+// A command's memory is either contiguous at its va or, with IDE_IOV,
+// the pages listed at va, one per block, so that the fs's I/O
+// scheduler can make one command of requests for neighbouring blocks
+// wherever their pages are.
+
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/assert.h>
+#include <inc/syscall.h>
+
+#include <kern/ide.h>
+#include <kern/pmap.h>
+#include <kern/picirq.h>
+
+#define SECTSIZE	512
+
+#define IDE_DF		0x20
+#define IDE_ERR		0x01
+
+// Bus master registers of the primary channel, at the I/O base in BAR 4
+#define BM_CMD		0
+#define   BM_CMD_START	0x01
+#define   BM_CMD_READ	0x08	// drive to memory
+#define BM_STATUS	2
+#define   BM_STATUS_ERR		0x02
+#define   BM_STATUS_INTR	0x04	// both cleared by writing 1
+#define BM_PRDT		4	// physical address of the PRD table
+
+// A physical region descriptor: one piece of the transfer's memory,
+// which may not cross a 64KB boundary.  Each is part of one page.
+struct Prd {
+	uint32_t prd_addr;
+	uint16_t prd_len;	// bytes, 0 means 64KB
+	uint16_t prd_flags;
+};
+#define PRD_EOT		0x8000	// the last one
+
+// Enough for the longest command, 256 sectors, from an unaligned address
+#define IDE_MAXPRD	(256 * SECTSIZE / PGSIZE + 1)
+
+static struct Prd prdt[IDE_MAXPRD] __attribute__((aligned(PGSIZE)));
+// The pages of the transfer in progress, held so that they can't be
+// freed under the drive if the fs unmaps them or exits.
+static struct PageInfo *dma_pages[IDE_MAXPRD];
+static int dma_npages;
+
+static uint16_t bm_base;	// 0 if there's no bus master
+
+// The page list of the IDE_IOV command in progress, 0 pages if it isn't
+static uintptr_t ide_iov[IDE_MAXPRD];
+static int ide_niov;
+static int pio_page;		// the page the next PIO interrupt moves
+
+int
+ide_attach(struct pci_func *pcif)
+{
+	pci_func_enable(pcif);
+#ifdef JOS_IDE_PIO
+	return 0;
+#endif
+	// both channels' registers, the primary's first
+	if (pcif->reg_size[4] >= 16)
+		bm_base = pcif->reg_base[4];
+	if (bm_base)
+		cprintf("IDE: bus-master DMA at port 0x%x\n", bm_base);
+	return 0;
+}
+
+// Copy in the page list of an IDE_IOV command and check that e may
+// move data to or from all of the pages.
+static void
+ide_load_iov(struct Env *e, const uintptr_t *iov, size_t nsecs, int op)
+{
+	size_t len = nsecs * SECTSIZE;
+	int i, n = ROUNDUP(len, PGSIZE) / PGSIZE;
+
+	if (n > IDE_MAXPRD) {
+		cprintf("[%08x] IDE command of %u sectors\n", e->env_id, nsecs);
+		env_destroy(e);
+	}
+	user_mem_assert(e, iov, n * sizeof(uintptr_t), PTE_U);
+	for (i = 0; i < n; i++) {
+		ide_iov[i] = ROUNDDOWN(iov[i], PGSIZE);
+		user_mem_assert(e, (void *) ide_iov[i], MIN(len - i * PGSIZE, PGSIZE),
+				PTE_U | (op == 0 ? PTE_W : 0));
+	}
+	ide_niov = n;
+}
+
+// The address of page k of e's command.
+static void *
+ide_page(struct Env *e, int k)
+{
+	if (ide_niov)
+		return (void *) ide_iov[k];
+	return (char *) e->chan + k * PGSIZE;
+}
+
+// Start a DMA transfer of nsecs sectors between the drive and e's
+// memory at va, for command op (0 read, 1 write).
+static void
+ide_dma_start(struct Env *e, void *va, size_t nsecs, int op)
+{
+	size_t off, len, total = nsecs * SECTSIZE;
+	struct PageInfo *pp;
+	uintptr_t p;
+	int n = 0;
+
+	if (!ide_niov)
+		user_mem_assert(e, va, total, PTE_U | (op == 0 ? PTE_W : 0));
+	for (off = 0; off < total; off += len, n++) {
+		p = ide_niov ? ide_iov[n] : (uintptr_t) va + off;
+		pp = page_lookup(e->env_pgdir, (void *) p, NULL);
+		len = MIN(total - off, PGSIZE - p % PGSIZE);
+		prdt[n].prd_addr = page2pa(pp) + p % PGSIZE;
+		prdt[n].prd_len = len;
+		prdt[n].prd_flags = 0;
+		pp->pp_ref++;
+		dma_pages[n] = pp;
+	}
+	prdt[n - 1].prd_flags = PRD_EOT;
+	dma_npages = n;
+
+	outl(bm_base + BM_PRDT, PADDR(prdt));
+	outb(bm_base + BM_CMD, op == 0 ? BM_CMD_READ : 0);
+	outb(bm_base + BM_STATUS, BM_STATUS_ERR | BM_STATUS_INTR);
+	outb(0x1F7, op == 0 ? 0xc8 : 0xca);	// READ DMA, WRITE DMA
+	outb(bm_base + BM_CMD, (op == 0 ? BM_CMD_READ : 0) | BM_CMD_START);
+}
+
+// Issue command op (read 0, write 1, no data 2, maybe | IDE_IOV) for
+// nsecs sectors at e's va, whose registers the fs has set up.
+void
+ide_start(struct Env *e, void *va, size_t nsecs, int op)
+{
+	bool iov = op & IDE_IOV;
+
+	op &= ~IDE_IOV;
+	ide_niov = 0;
+	pio_page = 0;
+	if (iov && op != 2 && nsecs > 0)
+		ide_load_iov(e, va, nsecs, op);
+	e->chan = va;
+	e->op = op;
+	e->nsecs = nsecs;
+	if (bm_base && op != 2 && nsecs > 0) {
+		ide_dma_start(e, va, nsecs, op);
+		return;
+	}
+
+	if (op == 0)
+	{
+		outb(0x1F7, nsecs > 1 ? 0xc4 : 0x20);	// CMD 0x20 means read sector
+	}
+	else if (op == 1)
+	{
+		outb(0x1F7, nsecs > 1 ? 0xc5 : 0x30);	// CMD 0x30 means write sector
+		outsl(0x1F0, ide_page(e, 0), PGSIZE / 4);
+	}
+	else
+	{
+		outb(0x1F7, 0xc6);	// CMD 0xc6 sets the sectors per multiple-mode IRQ
+	}
+}
+
+// Finish a DMA transfer.  Returns 0 if the drive isn't done yet.
+static bool
+ide_dma_intr(void)
+{
+	uint8_t st = inb(bm_base + BM_STATUS);
+	int i;
+
+	if (!(st & BM_STATUS_INTR))
+		return 0;
+	outb(bm_base + BM_CMD, 0);
+	outb(bm_base + BM_STATUS, BM_STATUS_ERR | BM_STATUS_INTR);
+	// reading the drive's status acknowledges its interrupt
+	if ((inb(0x1F7) & (IDE_DF|IDE_ERR)) || (st & BM_STATUS_ERR))
+		cprintf("IDE: DMA transfer failed, status %02x\n", st);
+	for (i = 0; i < dma_npages; i++)
+		page_decref(dma_pages[i]);
+	dma_npages = 0;
+	return 1;
+}
+
+// Move the PIO data for this interrupt.  Returns 0 if the command
+// isn't done yet.
+static bool
+ide_pio_intr(struct Env *e)
+{
+	// multi-sector commands interrupt once per page
+	// (fs/ide.c sets the drive's multiple mode so),
+	// read one in, or write the next one out
+	size_t left = e->nsecs > PGSIZE / SECTSIZE ? e->nsecs - PGSIZE / SECTSIZE : 0;
+	if (e->op == 0 || (e->op == 1 && left))
+	{
+		lcr3(PADDR(e->env_pgdir));
+		if (e->op == 0)
+			insl(0x1F0, ide_page(e, pio_page), PGSIZE / 4);
+		else
+			outsl(0x1F0, ide_page(e, pio_page + 1), PGSIZE / 4);
+		lcr3(PADDR(kern_pgdir));
+	}
+	pio_page++;
+	e->nsecs = left;
+	return !left || e->op == 2;
+}
+
+// The IDE interrupt: move data if need be, and once the command is
+// done wake the fs server.
+void
+ide_intr(void)
+{
+	struct Env *e = NULL;
+	bool done;
+	int i;
+
+	for (i = 0; i < NENV; i++)
+		if (envs[i].env_type == ENV_TYPE_FS)
+			e = &envs[i];
+
+	if (dma_npages)
+		done = ide_dma_intr();
+	else
+		done = e && ide_pio_intr(e);
+
+	// OCW2: send non-specific EOI command to give driver an ACK
+	// otherwise we won't receive the rest IDE interrupts followed
+	outb(IO_PIC1, 0x20);
+	outb(IO_PIC2, 0x20);
+	if (done && e)
+		ide_wakeup(e);
+}
+
+// Tell e that its disk command is done (kern/virtio.c uses this too).
+void
+ide_wakeup(struct Env *e)
+{
+	// finally, make fs runnable; after an IDE_ASYNC
+	// command it may be waiting for an IPC instead
+	// (see sys_ide_sleep), or not waiting at all
+	e->ide_async = 0;
+	e->nsecs = 0;
+	if (e->env_status == ENV_IDE_SLEEPING)
+		e->env_status = ENV_RUNNABLE;
+	else if (e->env_ipc_recving)
+	{
+		e->env_ipc_recving = 0;
+		e->env_ipc_from = 0;
+		e->env_ipc_value = 0;
+		e->env_ipc_perm = 0;
+		e->env_ipc_npages = 0;
+		e->env_tf.tf_regs.reg_eax = 0;
+		e->env_status = ENV_RUNNABLE;
+	}
+	else
+		e->ide_done = 1;
+}
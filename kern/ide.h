@@ -0,0 +1,21 @@
+#ifndef JOS_KERN_IDE_H
+#define JOS_KERN_IDE_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/env.h>
+#include <kern/pci.h>
+
+// The IDE function of the PIIX south bridge, whose bus master does DMA
+#define PIIX_VENDOR_ID		0x8086
+#define PIIX3_IDE_DEVICE_ID	0x7010
+#define PIIX4_IDE_DEVICE_ID	0x7111
+
+int ide_attach(struct pci_func *pcif);
+void ide_start(struct Env *e, void *va, size_t nsecs, int op);
+void ide_intr(void);
+void ide_wakeup(struct Env *e);
+
+#endif	// !JOS_KERN_IDE_H
@@ -0,0 +1,222 @@
+// Kernel same-page merging.
+//
+// Whenever a CPU has nothing to run, sched_halt() lets ksm_scan() hash
+// a few more user pages.  A page whose contents match one seen before
+// is remapped onto that frame, read-only and PTE_COW like lib/fork.c
+// does, and its own frame is released.  Merged frames carry PP_KSM so
+// that a write to one is resolved by the kernel (ksm_unshare) instead
+// of the environment's page fault handler, which may know nothing
+// about PTE_COW.
+
+#include <inc/x86.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/ksm.h>
+#include <kern/env.h>
+#include <kern/pmap.h>
+
+#define KSM_NSLOT	1024	// hash table slots, a collision evicts
+#define KSM_BATCH	64	// pages hashed per ksm_scan() call
+
+struct KsmSlot {
+	uint32_t hash;
+	struct PageInfo *pp;	// stable table: a PP_KSM frame
+	envid_t envid;		// unstable table: where a candidate was seen
+	uintptr_t va;
+};
+
+// Merged frames never change, so they can be found again by hash.
+static struct KsmSlot stable[KSM_NSLOT];
+// Candidates from the current pass, revalidated before merging.
+static struct KsmSlot unstable[KSM_NSLOT];
+
+#ifdef JOS_KSM
+int ksm_enabled = 1;
+#else
+int ksm_enabled = 0;
+#endif
+struct KsmStats ksm_stats;
+
+static int scan_env;
+static uintptr_t scan_va;
+
+static uint32_t
+page_hash(struct PageInfo *pp)
+{
+	uint32_t *p = page2kva(pp);
+	uint32_t h = 2166136261u;	// FNV-1a, a word at a time
+	int i;
+
+	for (i = 0; i < PGSIZE / 4; i++)
+		h = (h ^ p[i]) * 16777619u;
+	return h;
+}
+
+// Only ordinary user environments are merged: the fs server's block
+// cache relies on PTE_D, and nothing that might be running on another
+// CPU can have its page tables changed under it.  A sleeping one is
+// not running anywhere.
+static bool
+env_scannable(struct Env *e)
+{
+	return e->env_type == ENV_TYPE_USER
+		&& (e->env_status == ENV_RUNNABLE || e->env_status == ENV_NOT_RUNNABLE
+		    || e->env_status == ENV_SLEEPING);
+}
+
+static bool
+pte_mergeable(uintptr_t va, pte_t pte)
+{
+	// the kernel writes the exception stack directly
+	if (va == UXSTACKTOP - PGSIZE)
+		return 0;
+	// a frame mapped elsewhere too, other than copy-on-write, is shared
+	// memory, such as pages lent in an IPC or a MAP_SHARED block the fs
+	// server writes: merging would cut this mapping off from the other
+	// one's writes, read-only or not
+	if (!(pte & PTE_COW) && pa2page(PTE_ADDR(pte))->pp_ref > 1)
+		return 0;
+	return (pte & (PTE_P | PTE_U)) == (PTE_P | PTE_U) && !(pte & PTE_SHARE)
+		&& !(pa2page(PTE_ADDR(pte))->pp_flags & PP_KSM);
+}
+
+// Map the merged frame 'pp' at 'va' in place of whatever is there.
+// Writable mappings become copy-on-write.
+static void
+ksm_map(struct Env *e, uintptr_t va, pte_t pte, struct PageInfo *pp)
+{
+	int perm = pte & PTE_SYSCALL & ~PTE_W;
+
+	if (pte & (PTE_W | PTE_COW))
+		perm |= PTE_COW;
+	// the page table is already there, this cannot fail
+	page_insert(e->env_pgdir, pp, (void *)va, perm);
+}
+
+static void
+ksm_merge(struct Env *e, uintptr_t va, pte_t *pte)
+{
+	struct PageInfo *pp = pa2page(PTE_ADDR(*pte));
+	uint32_t h = page_hash(pp);
+	struct KsmSlot *s = &stable[h % KSM_NSLOT];
+	struct KsmSlot *u = &unstable[h % KSM_NSLOT];
+	struct Env *o;
+	pte_t *opte;
+	struct PageInfo *opp, *keep;
+
+	ksm_stats.scanned++;
+
+	if (s->pp && s->hash == h && (s->pp->pp_flags & PP_KSM)
+	    && memcmp(page2kva(s->pp), page2kva(pp), PGSIZE) == 0) {
+		ksm_map(e, va, *pte, s->pp);
+		ksm_stats.merged++;
+		return;
+	}
+
+	if (u->envid && u->hash == h && envid2env(u->envid, &o, 0) == 0
+	    && env_scannable(o)
+	    && (opte = pgdir_walk(o->env_pgdir, (void *)u->va, 0)) != NULL
+	    && pte_mergeable(u->va, *opte)
+	    && (opp = pa2page(PTE_ADDR(*opte))) != pp
+	    && memcmp(page2kva(opp), page2kva(pp), PGSIZE) == 0) {
+		// One of the two frames becomes the merged one, and it must
+		// be mapped nowhere else.  A copy-on-write mapping may share
+		// its frame with one that can still write it in place, like
+		// the fs server's own mapping of a block it handed a client
+		// copy-on-write, and the merged frame must never change.
+		keep = opp->pp_ref == 1 ? opp : pp->pp_ref == 1 ? pp : NULL;
+		if (keep) {
+			ksm_map(o, u->va, *opte, keep);
+			ksm_map(e, va, *pte, keep);
+			keep->pp_flags |= PP_KSM;
+			s->hash = h;
+			s->pp = keep;
+			u->envid = 0;
+			ksm_stats.merged++;
+			return;
+		}
+	}
+
+	u->hash = h;
+	u->envid = e->env_id;
+	u->va = va;
+}
+
+// Hash up to KSM_BATCH more user pages, merging any duplicates found.
+// Called with the kernel lock held and no environment on this CPU.
+void
+ksm_scan(void)
+{
+	uint64_t start;
+	struct Env *e;
+	pte_t *pte;
+	int n = 0, tries = 0;
+
+	if (!ksm_enabled)
+		return;
+
+	start = read_tsc();
+	while (n < KSM_BATCH && tries < NENV) {
+		e = &envs[scan_env];
+		if (env_scannable(e) && scan_va < UTOP) {
+			if (!(e->env_pgdir[PDX(scan_va)] & PTE_P)) {
+				scan_va = ROUNDDOWN(scan_va, PTSIZE) + PTSIZE;
+				continue;
+			}
+			pte = pgdir_walk(e->env_pgdir, (void *)scan_va, 0);
+			if (pte_mergeable(scan_va, *pte)) {
+				ksm_merge(e, scan_va, pte);
+				n++;
+			}
+			scan_va += PGSIZE;
+			continue;
+		}
+
+		// on to the next environment
+		scan_va = 0;
+		tries++;
+		if (++scan_env == NENV) {
+			scan_env = 0;
+			ksm_stats.passes++;
+			memset(unstable, 0, sizeof(unstable));
+		}
+	}
+	ksm_stats.cycles += read_tsc() - start;
+}
+
+// Give 'va' a private, writable copy of the merged frame mapped there.
+//
+// RETURNS:
+//   0 on success
+//   -E_INVAL, if 'va' is not a copy-on-write mapping of a merged frame
+//   -E_NO_MEM, if there's no memory for the copy
+//
+int
+ksm_unshare(pde_t *pgdir, void *va)
+{
+	pte_t *pte;
+	struct PageInfo *pp = page_lookup(pgdir, va, &pte);
+	struct PageInfo *np;
+	int perm;
+
+	if (pp == NULL || !(pp->pp_flags & PP_KSM) || !(*pte & PTE_COW))
+		return -E_INVAL;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	perm = (*pte & PTE_SYSCALL & ~PTE_COW) | PTE_W;
+	ksm_stats.unshared++;
+	if (pp->pp_ref == 1) {
+		// last mapping, just take the frame back
+		pp->pp_flags &= ~PP_KSM;
+		*pte = page2pa(pp) | perm;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
+
+	if ((np = page_alloc(0)) == NULL)
+		return -E_NO_MEM;
+	memcpy(page2kva(np), page2kva(pp), PGSIZE);
+	return page_insert(pgdir, np, va, perm);
+}
@@ -0,0 +1,24 @@
+#ifndef JOS_KERN_KSM_H
+#define JOS_KERN_KSM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+
+struct KsmStats {
+	uint32_t scanned;	// pages hashed
+	uint32_t merged;	// frames released by merging
+	uint32_t unshared;	// copy-on-write breaks of merged frames
+	uint32_t passes;	// complete sweeps over envs[]
+	uint64_t cycles;	// TSC cycles spent in ksm_scan()
+};
+
+extern int ksm_enabled;
+extern struct KsmStats ksm_stats;
+
+void ksm_scan(void);
+int ksm_unshare(pde_t *pgdir, void *va);
+
+#endif /* JOS_KERN_KSM_H */
@@ -12,6 +12,7 @@
 #include <kern/kdebug.h>
 #include <kern/trap.h>
 #include <kern/pmap.h>
+#include <kern/ksm.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
 
@@ -28,7 +29,8 @@ static struct Command commands[] = {
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
 	{ "backtrace", "Display backtrace to current function call", mon_backtrace},
 	{ "showmappings", "Display memory mappings in current active address space", mon_showmappings},
-	{ "debug", "Debug purpose", mon_debug}
+	{ "debug", "Debug purpose", mon_debug},
+	{ "ksm", "Show same-page merging statistics, 'on'/'off' toggles the scanner", mon_ksm}
 };
 
 /***** Implementations of basic kernel monitor commands *****/
@@ -167,6 +169,25 @@ int mon_debug(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+int mon_ksm(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc == 2 && strcmp(argv[1], "on") == 0)
+		ksm_enabled = 1;
+	else if (argc == 2 && strcmp(argv[1], "off") == 0)
+		ksm_enabled = 0;
+	else if (argc != 1)
+	{
+		cprintf("usage: ksm [on|off]\n");
+		return 0;
+	}
+
+	cprintf("Same-page merging is %s\n", ksm_enabled ? "on" : "off");
+	cprintf("  %u pages merged, %u unshared\n", ksm_stats.merged, ksm_stats.unshared);
+	cprintf("  %u pages scanned in %u full passes\n", ksm_stats.scanned, ksm_stats.passes);
+	cprintf("  %llu cycles spent scanning\n", ksm_stats.cycles);
+	return 0;
+}
+
 /***** Kernel monitor command interpreter *****/
 
 #define WHITESPACE "\t\r\n "
@@ -4,6 +4,8 @@
 #include <kern/pci.h>
 #include <kern/pcireg.h>
 #include <kern/e1000.h>
+#include <kern/ide.h>
+#include <kern/virtio.h>
 
 // Flag to do "lspci" at bootup
 static int pci_show_devs = 1;
@@ -33,6 +35,9 @@ struct pci_driver pci_attach_class[] = {
 // and key2 should be the vendor ID and device ID respectively
 struct pci_driver pci_attach_vendor[] = {
 	{ E1000_VENDOR_ID, E1000_DEVICE_ID, &pci_func_attach },
+	{ PIIX_VENDOR_ID, PIIX3_IDE_DEVICE_ID, &ide_attach },
+	{ PIIX_VENDOR_ID, PIIX4_IDE_DEVICE_ID, &ide_attach },
+	{ VIRTIO_VENDOR_ID, VIRTIO_BLK_DEVICE_ID, &vblk_attach },
 	{ 0, 0, 0 },
 };
 
@@ -10,6 +10,7 @@
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/cpu.h>
+#include <kern/ksm.h>
 
 // These variables are set by i386_detect_memory()
 size_t npages;			// Amount of physical memory (in pages)
@@ -425,6 +426,7 @@ page_free(struct PageInfo *pp)
 	{
 		panic("Page is still in use! Cannot be freed");
 	}
+	pp->pp_flags = 0;
 	pp->pp_link = page_free_list;
 	page_free_list = pp;
 }
@@ -647,6 +649,56 @@ page_remove(pde_t *pgdir, void *va)
 		*pte_store = 0;
 		tlb_invalidate(pgdir, va);
 	}
+	else if ((pte_store = pgdir_walk(pgdir, va, 0)) != NULL)
+	{
+		// drop a demand-zero reservation, if any
+		*pte_store = 0;
+	}
+}
+
+//
+// Reserve the page at virtual address 'va' as demand-zero: no physical
+// page is allocated now, page_demand_zero() maps a zeroed one with
+// permissions 'perm|PTE_P' on first touch.
+// Any page already mapped at 'va' is page_remove()d.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if page table couldn't be allocated
+//
+int
+page_reserve(pde_t *pgdir, void *va, int perm)
+{
+	pte_t *pg_tbl_entry;
+
+	page_remove(pgdir, va);
+	if ((pg_tbl_entry = pgdir_walk(pgdir, va, 1)) == NULL)
+		return -E_NO_MEM;
+	*pg_tbl_entry = (perm & ~PTE_P) | PTE_DZ;
+	return 0;
+}
+
+//
+// If the page at 'va' was reserved with page_reserve(), allocate a zeroed
+// page and map it there.
+//
+// RETURNS:
+//   0 on success
+//   -E_FAULT, if 'va' is not a demand-zero reservation
+//   -E_NO_MEM, if there's no memory to allocate the page
+//
+int
+page_demand_zero(pde_t *pgdir, void *va)
+{
+	pte_t *pg_tbl_entry = pgdir_walk(pgdir, va, 0);
+	struct PageInfo *pp;
+
+	if (pg_tbl_entry == NULL || (*pg_tbl_entry & (PTE_P | PTE_DZ)) != PTE_DZ)
+		return -E_FAULT;
+	if ((pp = page_alloc(ALLOC_ZERO)) == NULL)
+		return -E_NO_MEM;
+	// cannot fail, the page table is already there
+	return page_insert(pgdir, pp, ROUNDDOWN(va, PGSIZE), (*pg_tbl_entry & PTE_SYSCALL) | PTE_P);
 }
 
 //
@@ -743,6 +795,11 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 		}
 
 		pte_t *pgtbl_entry = pgdir_walk(env->env_pgdir, (const void *)pg, 0);
+		// the kernel is about to touch it on the user's behalf
+		if (pgtbl_entry && (*pgtbl_entry & PTE_DZ) && !(*pgtbl_entry & PTE_P))
+			page_demand_zero(env->env_pgdir, (void *)pg);
+		if (perm & PTE_W)
+			ksm_unshare(env->env_pgdir, (void *)pg);
 		if (!pgtbl_entry || !(*pgtbl_entry & perm) || !(*pgtbl_entry & PTE_P))
 		{
 			user_mem_check_addr = pg == start ? (uintptr_t)va : pg;
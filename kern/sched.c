@@ -4,6 +4,8 @@
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/ksm.h>
+#include <kern/time.h>
 
 void sched_halt(void);
 
@@ -51,6 +53,20 @@ sched_yield(void)
 	sched_halt();
 }
 
+// Make the environments whose sys_sleep is over runnable again.
+// Called on every timer interrupt.
+void
+sched_wake(void)
+{
+	uint32_t now = time_msec();
+	int i;
+
+	for (i = 0; i < NENV; i++)
+		if (envs[i].env_status == ENV_SLEEPING
+		    && (int32_t) (now - envs[i].env_wakeup) >= 0)
+			envs[i].env_status = ENV_RUNNABLE;
+}
+
 // Halt this CPU when there is nothing to do. Wait until the
 // timer interrupt wakes it up. This function never returns.
 //
@@ -66,7 +82,9 @@ sched_halt(void)
 		     envs[i].env_status == ENV_RUNNING ||
 		     envs[i].env_status == ENV_DYING ||
 		     envs[i].env_status == ENV_IDE_SLEEPING) ||
-			 envs[i].env_status == ENV_NS_WAITING)
+			 envs[i].env_status == ENV_NS_WAITING ||
+			 envs[i].env_status == ENV_SLEEPING ||
+			 envs[i].ide_async)
 			break;
 	}
 	if (i == NENV) {
@@ -79,6 +97,9 @@ sched_halt(void)
 	curenv = NULL;
 	lcr3(PADDR(kern_pgdir));
 
+	// Put the idle time to use merging duplicate pages
+	ksm_scan();
+
 	// Mark that this CPU is in the HALT state, so that when
 	// timer interupts come in, we know we should re-acquire the
 	// big kernel lock
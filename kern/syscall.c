@@ -10,9 +10,12 @@
 #include <kern/trap.h>
 #include <kern/syscall.h>
 #include <kern/console.h>
+#include <kern/ide.h>
+#include <kern/virtio.h>
 #include <kern/sched.h>
 #include <kern/time.h>
 #include <kern/e1000.h>
+#include <kern/ksm.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -216,6 +219,39 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	return 0;
 }
 
+// Reserve the 'len' bytes starting at 'va' in envid's address space as
+// demand-zero memory: no physical pages are allocated now, a zeroed page
+// is mapped with permission 'perm' the first time each page is touched.
+// Pages already mapped in the range are unmapped as a side effect.
+//
+// perm -- same restrictions as in sys_page_alloc.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va or len is not page-aligned, or va + len > UTOP.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_NO_MEM if there's no memory to allocate any necessary page tables.
+static int
+sys_page_reserve(envid_t envid, void *va, size_t len, int perm)
+{
+	struct Env *env = NULL;
+	uintptr_t start = (uintptr_t)va;
+	uintptr_t pg;
+
+	if (envid2env(envid, &env, 1) != 0)
+		return -E_BAD_ENV;
+	if (start % PGSIZE || len % PGSIZE || start > UTOP || len > UTOP - start)
+		return -E_INVAL;
+	if ((perm & PTE_P) != PTE_P || (perm & PTE_U) != PTE_U || (perm & ~PTE_SYSCALL) != 0)
+		return -E_INVAL;
+
+	for (pg = start; pg < start + len; pg += PGSIZE)
+		if (page_reserve(env->env_pgdir, (void *)pg, perm) != 0)
+			return -E_NO_MEM;
+	return 0;
+}
+
 // Map the page of memory at 'srcva' in srcenvid's address space
 // at 'dstva' in dstenvid's address space with permission 'perm'.
 // Perm has the same restrictions as in sys_page_alloc, except
@@ -248,6 +284,11 @@ sys_page_map(envid_t srcenvid, void *srcva,
 	if ((uintptr_t)srcva >= UTOP || (uintptr_t)dstva >= UTOP || (uintptr_t)srcva % PGSIZE || (uintptr_t)dstva % PGSIZE)
 		return -E_INVAL;
 
+	// a demand-zero page gets its frame now, so both sides share it
+	page_demand_zero(srcenv->env_pgdir, srcva);
+	// only a copy-on-write mapping may keep sharing a merged frame
+	if (!(perm & PTE_COW))
+		ksm_unshare(srcenv->env_pgdir, srcva);
 	pte_t *src_pgtbl_entry = NULL;
 	struct PageInfo *src_page = page_lookup(srcenv->env_pgdir, srcva, &src_pgtbl_entry);
 	if (src_page == NULL || (perm & PTE_P) != PTE_P || (perm & PTE_U) != PTE_U || (perm & ~PTE_SYSCALL) != 0)
@@ -282,6 +323,8 @@ sys_page_unmap(envid_t envid, void *va)
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
+// 'npages' pages from 'srcva' on are sent together, up to as many as
+// the receiver asked for in sys_ipc_recv.
 //
 // The send fails with a return value of -E_IPC_NOT_RECV if the
 // target is not blocked, waiting for an IPC.
@@ -293,7 +336,8 @@ sys_page_unmap(envid_t envid, void *va)
 //    env_ipc_recving is set to 0 to block future sends;
 //    env_ipc_from is set to the sending envid;
 //    env_ipc_value is set to the 'value' parameter;
-//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise.
+//    env_ipc_perm is set to 'perm' if a page was transferred, 0 otherwise;
+//    env_ipc_npages is set to the number of pages transferred.
 // The target environment is marked runnable again, returning 0
 // from the paused sys_ipc_recv system call.  (Hint: does the
 // sys_ipc_recv function ever actually return?)
@@ -309,6 +353,7 @@ sys_page_unmap(envid_t envid, void *va)
 //	-E_IPC_NOT_RECV if envid is not currently blocked in sys_ipc_recv,
 //		or another environment managed to send first.
 //	-E_INVAL if srcva < UTOP but srcva is not page-aligned.
+//	-E_INVAL if npages is 0 or more than IPC_MAXPAGES.
 //	-E_INVAL if srcva < UTOP and perm is inappropriate
 //		(see sys_page_alloc).
 //	-E_INVAL if srcva < UTOP but srcva is not mapped in the caller's
@@ -323,33 +368,52 @@ sys_page_unmap(envid_t envid, void *va)
 // switch to scheduler and run other tasks, we can jump back later(but not in user
 // space, so we need to persist kernel stack for later use)
 static int
-sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm,
+		 size_t npages)
 {
 	// LAB 4: Your code here.
 	struct Env *env = NULL;
 	int r = 0;
-	struct PageInfo *pp = NULL;
+	size_t i;
+	struct PageInfo *pp[IPC_MAXPAGES];
 	pte_t *pgtbl_entry = NULL;
+	void *va;
 	if ((r = envid2env(envid, &env, 0)) != 0)
 		return r;
 	if (env->env_ipc_recving == 0)
 		return -E_IPC_NOT_RECV;
-	if ((uintptr_t)srcva < UTOP && (uintptr_t)srcva % PGSIZE)
+	if (npages == 0 || npages > IPC_MAXPAGES)
 		return -E_INVAL;
-	if ((uintptr_t)srcva < UTOP && ((perm & PTE_P) != PTE_P || (perm & PTE_U) != PTE_U || (perm & ~PTE_SYSCALL) != 0))
-		return -E_INVAL;
-	if ((uintptr_t)srcva < UTOP && (pp = page_lookup(curenv->env_pgdir, srcva, &pgtbl_entry)) == NULL)
+	if ((uintptr_t)srcva < UTOP && ((uintptr_t)srcva % PGSIZE || (uintptr_t)srcva + npages * PGSIZE > UTOP))
 		return -E_INVAL;
-	if ((uintptr_t)srcva < UTOP && (perm & PTE_W) && !(*pgtbl_entry & PTE_W))
+	if ((uintptr_t)srcva < UTOP && ((perm & PTE_P) != PTE_P || (perm & PTE_U) != PTE_U || (perm & ~PTE_SYSCALL) != 0))
 		return -E_INVAL;
+	for (i = 0; (uintptr_t)srcva < UTOP && i < npages; i++) {
+		va = srcva + i * PGSIZE;
+		page_demand_zero(curenv->env_pgdir, va);
+		if (!(perm & PTE_COW))
+			ksm_unshare(curenv->env_pgdir, va);
+		if ((pp[i] = page_lookup(curenv->env_pgdir, va, &pgtbl_entry)) == NULL)
+			return -E_INVAL;
+		if ((perm & PTE_W) && !(*pgtbl_entry & PTE_W))
+			return -E_INVAL;
+	}
 
 	env->env_ipc_perm = 0;
+	env->env_ipc_npages = 0;
 	if ((uintptr_t)srcva < UTOP && (uintptr_t)(env->env_ipc_dstva) < UTOP)
 	{
-		// send a page, install it in receiver's address space
-		if ((r = page_insert(env->env_pgdir, pp, env->env_ipc_dstva, perm)) != 0)
-			return r;
+		// send the pages, as many as the receiver asked for at most,
+		// install them in receiver's address space
+		npages = MIN(npages, env->env_ipc_maxpages);
+		for (i = 0; i < npages; i++)
+			if ((r = page_insert(env->env_pgdir, pp[i], env->env_ipc_dstva + i * PGSIZE, perm)) != 0) {
+				while (i-- > 0)
+					page_remove(env->env_pgdir, env->env_ipc_dstva + i * PGSIZE);
+				return r;
+			}
 		env->env_ipc_perm = perm;	// update perm if there is actually a page being transferred
+		env->env_ipc_npages = npages;
 	}
 	env->env_ipc_recving = 0;
 	env->env_ipc_from = curenv->env_id;
@@ -366,19 +430,34 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 //
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
+// Up to 'npages' consecutive pages are taken there if the sender sends
+// a range (0 means 1); env_ipc_npages says how many came.
 //
 // This function only returns on error, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error.  Errors are:
-//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned,
+//		or the pages would reach past UTOP.
 static int
-sys_ipc_recv(void *dstva)
+sys_ipc_recv(void *dstva, size_t npages)
 {
 	// LAB 4: Your code here.
-	if ((uintptr_t)dstva < UTOP && (uintptr_t)dstva % PGSIZE)
+	if (npages == 0)
+		npages = 1;
+	if ((uintptr_t)dstva < UTOP && ((uintptr_t)dstva % PGSIZE || npages > IPC_MAXPAGES || (uintptr_t)dstva + npages * PGSIZE > UTOP))
 		return -E_INVAL;
+	// an IDE_ASYNC command finished while we were busy
+	if (curenv->ide_done) {
+		curenv->ide_done = 0;
+		curenv->env_ipc_from = 0;
+		curenv->env_ipc_value = 0;
+		curenv->env_ipc_perm = 0;
+		curenv->env_ipc_npages = 0;
+		return 0;
+	}
 	curenv->env_ipc_recving = 1;	// ready for receiving something
 	curenv->env_ipc_dstva = dstva;	// tell sender if we want a page
+	curenv->env_ipc_maxpages = npages;
 
 	// now we give up CPU
 	curenv->env_status = ENV_NOT_RUNNABLE;
@@ -395,25 +474,72 @@ sys_time_msec(void)
 	return time_msec();
 }
 
-static void
+// Start an IDE command whose registers the fs has set up, and sleep
+// until its data has moved (see kern/ide.c).
+// With IDE_ASYNC, return at once instead: when the command is done,
+// a sys_ipc_recv the env is blocked in returns as if envid 0 had sent
+// it 0, or, if it isn't receiving, its next sys_ipc_recv or IDE_WAIT
+// returns at once.  IDE_WAIT sleeps until the IDE_ASYNC command is done.
+// Only the fs server drives the disk.
+static int
 sys_ide_sleep(void *chan, size_t nsecs, int op)
 {
-	int r;
-	if (op == 0)
-	{
-		outb(0x1F7, nsecs > 1 ? 0xc4 : 0x20);	// CMD 0x20 means read sector
-	}
-	else
+	bool async = op & IDE_ASYNC;
+
+	if (curenv->env_type != ENV_TYPE_FS)
+		return -E_BAD_ENV;
+	op &= ~IDE_ASYNC;
+	if (op == IDE_WAIT)
 	{
-		outb(0x1F7, nsecs > 1 ? 0xc5 : 0x30);	// CMD 0x30 means write sector
-		outsl(0x1F0, chan, PGSIZE / 4);
+		if (curenv->ide_done)
+		{
+			curenv->ide_done = 0;
+			return 0;
+		}
+		curenv->env_status = ENV_IDE_SLEEPING;
+		sched_yield();
 	}
-	curenv->chan = chan;
+
+	ide_start(curenv, chan, nsecs, op);
+	curenv->ide_async = async;
+	if (async)
+		return 0;
 	curenv->env_status = ENV_IDE_SLEEPING;
-	curenv->op = op;
 	sched_yield();
 }
 
+// Block for at least msec milliseconds, without using a CPU meanwhile.
+static int
+sys_sleep(uint32_t msec)
+{
+	if (msec == 0)
+		return 0;
+	// time_msec() only moves in 10 msec ticks: wait one more
+	curenv->env_wakeup = time_msec() + msec + 10;
+	curenv->env_status = ENV_SLEEPING;
+	curenv->env_tf.tf_regs.reg_eax = 0;
+	sched_yield();
+}
+
+// Queue a virtio-blk request, see vblk_submit.  Only the fs server
+// drives the disk.
+static int
+sys_vblk_submit(uint32_t tag, uint32_t secno, void *va, size_t nsecs, int op)
+{
+	if (curenv->env_type != ENV_TYPE_FS)
+		return -E_BAD_ENV;
+	return vblk_submit(curenv, tag, secno, va, nsecs, op);
+}
+
+// Collect finished virtio-blk requests, see vblk_reap.
+static int
+sys_vblk_reap(uint32_t *tags, int max)
+{
+	if (curenv->env_type != ENV_TYPE_FS)
+		return -E_BAD_ENV;
+	return vblk_reap(curenv, tags, max);
+}
+
 static int
 sys_send(const void *buffer, size_t length)
 {
@@ -465,17 +591,27 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	case SYS_yield:
 		sys_yield();
 	case SYS_ipc_try_send:
-		return sys_ipc_try_send(a1, a2, (void *)a3, a4);
+		return sys_ipc_try_send(a1, a2, (void *)a3, a4, 1);
+	case SYS_ipc_send_pages:
+		return sys_ipc_try_send(a1, a2, (void *)a3, a4, a5);
 	case SYS_ipc_recv:
-		return sys_ipc_recv((void *)a1);
+		return sys_ipc_recv((void *)a1, a2);
 	case SYS_time_msec:
 		return sys_time_msec();
 	case SYS_ide_sleep:
-		sys_ide_sleep((void *)a1, a2, (int)a3);
+		return sys_ide_sleep((void *)a1, a2, (int)a3);
 	case SYS_send:
 		return sys_send((const void*)a1, a2);
 	case SYS_recv:
 		return sys_recv((void *)a1, a2);
+	case SYS_page_reserve:
+		return sys_page_reserve(a1, (void *)a2, a3, a4);
+	case SYS_vblk_submit:
+		return sys_vblk_submit(a1, a2, (void *)a3, a4, a5);
+	case SYS_vblk_reap:
+		return sys_vblk_reap((uint32_t *)a1, a2);
+	case SYS_sleep:
+		return sys_sleep(a1);
 	case NSYSCALLS:
 	default:
 		return -E_INVAL;
@@ -15,6 +15,9 @@
 #include <kern/spinlock.h>
 #include <kern/time.h>
 #include <kern/e1000.h>
+#include <kern/ide.h>
+#include <kern/virtio.h>
+#include <kern/ksm.h>
 
 static struct Taskstate ts;
 
@@ -226,6 +229,22 @@ trap_dispatch(struct Trapframe *tf)
 		return;
 	}
 
+	// The virtio-blk disk's interrupt line is wherever the PCI
+	// configuration put it (see kern/virtio.c)
+	if (vblk_irq && tf->tf_trapno == IRQ_OFFSET + vblk_irq) {
+		vblk_intr();
+		// a line it may share with the e1000
+		if (vblk_irq != e1000_irq)
+			return;
+	}
+
+	// Likewise the e1000's (see pci_func_attach)
+	if (e1000_irq && tf->tf_trapno == IRQ_OFFSET + e1000_irq) {
+		e1000_intr();
+		lapic_eoi();
+		return;
+	}
+
 	// Handle spurious interrupts
 	// The hardware sometimes raises these because of noise on the
 	// IRQ line or other reasons. We don't care.
@@ -244,6 +263,7 @@ trap_dispatch(struct Trapframe *tf)
 		{
 		case IRQ_OFFSET + IRQ_TIMER:
 			time_tick();
+			sched_wake();
 			lapic_eoi();
 			sched_yield();
 			break;
@@ -259,40 +279,9 @@ trap_dispatch(struct Trapframe *tf)
 			return;
 
 		case IRQ_OFFSET + IRQ_IDE:
-			for (int i = 0; i < NENV; i++)
-			{
-				if (envs[i].env_type == ENV_TYPE_FS)
-				{
-					// read a BLKSIZE from disk if needed then acknowledge the interrupt
-					if (envs[i].op == 0)
-					{
-						lcr3(PADDR(envs[i].env_pgdir));
-						insl(0x1F0, envs[i].chan, PGSIZE / 4);
-						envs[i].chan = 0;
-						lcr3(PADDR(kern_pgdir));
-					}
-					// OCW2: send non-specific EOI command to give driver an ACK
-					// otherwise we won't receive the rest IDE interrupts followed
-					outb(IO_PIC1, 0x20);
-					outb(IO_PIC2, 0x20);
-					// finally, make fs runnable
-					if (envs[i].env_status == ENV_IDE_SLEEPING)
-						envs[i].env_status = ENV_RUNNABLE;
-					else
-					{
-						// shouldn't be here
-						cprintf("status: %u\n", envs[i].env_status);
-						print_trapframe(tf);
-					}
-					return;
-				}
-			}
-		
-		case IRQ_OFFSET + 11:
-		    e1000_intr();
-			lapic_eoi();
+			ide_intr();
 			return;
-		
+
 		default:
 			break;
 		}
@@ -413,6 +402,15 @@ page_fault_handler(struct Trapframe *tf)
 	// We've already handled kernel-mode exceptions, so if we get here,
 	// the page fault happened in user mode.
 
+	// First touch of a demand-zero page (see sys_page_reserve), the
+	// kernel resolves it without bothering the user's upcall.
+	if (!(tf->tf_err & FEC_PR) && page_demand_zero(curenv->env_pgdir, (void *)fault_va) == 0)
+		env_run(curenv);
+	// Likewise a write to a frame the kernel merged (see kern/ksm.c).
+	if ((tf->tf_err & (FEC_PR | FEC_WR)) == (FEC_PR | FEC_WR)
+	    && ksm_unshare(curenv->env_pgdir, (void *)fault_va) == 0)
+		env_run(curenv);
+
 	// Call the environment's page fault upcall, if one exists.  Set up a
 	// page fault stack frame on the user exception stack (below
 	// UXSTACKTOP), then branch to curenv->env_pgfault_upcall.
@@ -0,0 +1,335 @@
+// virtio-blk disk driver, legacy PCI interface.
+//
+// Unlike the IDE disk, which runs one command at a time, the device
+// takes requests through a virtqueue: the fs server hands in as many
+// as there are descriptors for with sys_vblk_submit, and collects the
+// tags of finished ones, in batches, with sys_vblk_reap.  The device
+// reads and writes the fs server's pages directly.  Finishing
+// requests wakes the fs server just as an IDE_ASYNC command does (see
+// sys_ide_sleep).
+
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+#include <inc/syscall.h>
+
+#include <kern/virtio.h>
+#include <kern/ide.h>
+#include <kern/pmap.h>
+#include <kern/picirq.h>
+
+#define SECTSIZE	512
+
+// Registers, at the I/O base in BAR 0
+#define VIRTIO_HOST_FEATURES	0x00
+#define VIRTIO_GUEST_FEATURES	0x04
+#define VIRTIO_QUEUE_PFN	0x08
+#define VIRTIO_QUEUE_NUM	0x0C
+#define VIRTIO_QUEUE_SEL	0x0E
+#define VIRTIO_QUEUE_NOTIFY	0x10
+#define VIRTIO_STATUS		0x12
+#define   VIRTIO_STATUS_ACK		0x01
+#define   VIRTIO_STATUS_DRIVER		0x02
+#define   VIRTIO_STATUS_DRIVER_OK	0x04
+#define VIRTIO_ISR		0x13	// reading acknowledges the interrupt
+#define VIRTIO_BLK_CAPACITY	0x14	// in sectors, 64 bits
+
+struct VirtqDesc {
+	uint64_t addr;
+	uint32_t len;
+	uint16_t flags;
+	uint16_t next;
+};
+#define VIRTQ_DESC_F_NEXT	1
+#define VIRTQ_DESC_F_WRITE	2	// the device writes this buffer
+
+struct VirtqAvail {
+	uint16_t flags;
+	uint16_t idx;
+	uint16_t ring[];
+};
+
+struct VirtqUsed {
+	uint16_t flags;
+	uint16_t idx;
+	struct {
+		uint32_t id;	// head of the finished descriptor chain
+		uint32_t len;
+	} ring[];
+};
+
+// Each request is a header, the data, a page at a time, and a status
+// byte, each in a descriptor.
+struct VblkHdr {
+	uint32_t type;
+	uint32_t ioprio;
+	uint64_t sector;
+};
+#define VIRTIO_BLK_T_IN		0
+#define VIRTIO_BLK_T_OUT	1
+
+// The longest request, 256 sectors, from an unaligned address
+#define VBLK_MAXPAGES	(256 * SECTSIZE / PGSIZE + 1)
+#define VBLK_NREQ	64	// requests in flight or waiting to be reaped
+
+struct VblkReq {
+	struct VblkHdr r_hdr;
+	uint8_t r_status;
+	bool r_busy;		// until reaped
+	bool r_done;
+	uint32_t r_tag;
+	envid_t r_env;
+	uint16_t r_head;	// first descriptor
+	int r_npages;
+	struct PageInfo *r_pages[VBLK_MAXPAGES];	// held while in flight
+};
+
+// The queue: descriptors, then the available ring, then, on the next
+// page, the used ring.  Room for the largest queue we accept.
+#define VQ_MAXNUM	256
+static uint8_t vq_mem[3 * PGSIZE] __attribute__((aligned(PGSIZE)));
+static struct VirtqDesc *vq_desc;
+static struct VirtqAvail *vq_avail;
+static struct VirtqUsed *vq_used;
+static uint16_t vq_num;			// queue size, 0 if no device
+static uint16_t vq_free = 0xFFFF;	// free descriptors, chained by next
+static uint16_t vq_nfree;
+static uint16_t vq_last_used;
+
+static struct VblkReq vblk_reqs[VBLK_NREQ];
+static uint8_t vblk_head_req[VQ_MAXNUM];	// which request a chain is
+static uint8_t vblk_done[VBLK_NREQ];		// finished, oldest first
+static int vblk_ndone;
+
+static uint16_t vblk_base;
+uint8_t vblk_irq;
+
+int
+vblk_attach(struct pci_func *pcif)
+{
+	uint32_t i, sectors;
+
+	pci_func_enable(pcif);
+	vblk_base = pcif->reg_base[0];
+
+	outb(vblk_base + VIRTIO_STATUS, 0);	// reset
+	outb(vblk_base + VIRTIO_STATUS, VIRTIO_STATUS_ACK);
+	outb(vblk_base + VIRTIO_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+	outl(vblk_base + VIRTIO_GUEST_FEATURES, 0);
+
+	outw(vblk_base + VIRTIO_QUEUE_SEL, 0);
+	vq_num = inw(vblk_base + VIRTIO_QUEUE_NUM);
+	if (vq_num == 0 || vq_num > VQ_MAXNUM) {
+		cprintf("virtio-blk: queue of %d entries not supported\n", vq_num);
+		vq_num = 0;
+		return 0;
+	}
+	vq_desc = (struct VirtqDesc *) vq_mem;
+	vq_avail = (struct VirtqAvail *) (vq_mem + vq_num * sizeof(struct VirtqDesc));
+	vq_used = (struct VirtqUsed *) ROUNDUP((uintptr_t) &vq_avail->ring[vq_num + 1], PGSIZE);
+	for (i = 0; i < vq_num; i++) {
+		vq_desc[i].next = vq_free;
+		vq_free = i;
+	}
+	vq_nfree = vq_num;
+	outl(vblk_base + VIRTIO_QUEUE_PFN, PADDR(vq_mem) >> PGSHIFT);
+
+	vblk_irq = pcif->irq_line;
+	irq_setmask_8259A(irq_mask_8259A & ~(1 << vblk_irq));
+	outb(vblk_base + VIRTIO_STATUS, VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER
+	     | VIRTIO_STATUS_DRIVER_OK);
+
+	sectors = inl(vblk_base + VIRTIO_BLK_CAPACITY);
+	cprintf("virtio-blk: %d sectors, queue of %d, irq %d\n",
+		sectors, vq_num, vblk_irq);
+	return 0;
+}
+
+static uint16_t
+vq_alloc_desc(void)
+{
+	uint16_t d = vq_free;
+
+	vq_free = vq_desc[d].next;
+	vq_nfree--;
+	return d;
+}
+
+// Queue a request to move nsecs sectors at secno to (op 1, write) or
+// from (op 0, read) e's memory at va.  With IDE_IOV or'd into op, va
+// lists the pages instead, as for sys_ide_sleep.  'tag' is what
+// vblk_reap gives back once it is done.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NOT_SUPP if there's no virtio-blk disk.
+//	-E_INVAL if nsecs is 0 or over 256, or op is bad.
+//	-E_NO_MEM if the queue is full; reap some requests first.
+int
+vblk_submit(struct Env *e, uint32_t tag, uint32_t secno, void *va,
+	    size_t nsecs, int op)
+{
+	uintptr_t p, iov[VBLK_MAXPAGES];
+	size_t off, len, total = nsecs * SECTSIZE;
+	bool write = (op & ~IDE_IOV) == 1;
+	int perm = PTE_U | (write ? 0 : PTE_W);
+	struct VblkReq *r;
+	struct PageInfo *pp;
+	uint16_t d, prev;
+	int i, npages;
+
+	if (!vq_num)
+		return -E_NOT_SUPP;
+	if (nsecs == 0 || nsecs > 256 || (op & ~IDE_IOV) > 1)
+		return -E_INVAL;
+	if (op & IDE_IOV) {
+		npages = ROUNDUP(total, PGSIZE) / PGSIZE;
+		user_mem_assert(e, va, npages * sizeof(uintptr_t), PTE_U);
+		for (i = 0; i < npages; i++) {
+			iov[i] = ROUNDDOWN(((uintptr_t *) va)[i], PGSIZE);
+			user_mem_assert(e, (void *) iov[i],
+					MIN(total - i * PGSIZE, PGSIZE), perm);
+		}
+	} else {
+		user_mem_assert(e, va, total, perm);
+		npages = (ROUNDUP((uintptr_t) va + total, PGSIZE)
+			  - ROUNDDOWN((uintptr_t) va, PGSIZE)) / PGSIZE;
+	}
+
+	for (r = vblk_reqs; r < vblk_reqs + VBLK_NREQ && r->r_busy; r++)
+		;
+	if (r == vblk_reqs + VBLK_NREQ || vq_nfree < npages + 2)
+		return -E_NO_MEM;
+
+	r->r_hdr.type = write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+	r->r_hdr.ioprio = 0;
+	r->r_hdr.sector = secno;
+	r->r_status = 0xFF;
+	r->r_busy = 1;
+	r->r_done = 0;
+	r->r_tag = tag;
+	r->r_env = e->env_id;
+	r->r_npages = 0;
+
+	r->r_head = prev = vq_alloc_desc();
+	vq_desc[prev].addr = PADDR(&r->r_hdr);
+	vq_desc[prev].len = sizeof(r->r_hdr);
+	vq_desc[prev].flags = VIRTQ_DESC_F_NEXT;
+	for (off = 0; off < total; off += len) {
+		p = (op & IDE_IOV) ? iov[r->r_npages] : (uintptr_t) va + off;
+		pp = page_lookup(e->env_pgdir, (void *) p, NULL);
+		len = MIN(total - off, PGSIZE - p % PGSIZE);
+		pp->pp_ref++;
+		r->r_pages[r->r_npages++] = pp;
+
+		d = vq_alloc_desc();
+		vq_desc[d].addr = page2pa(pp) + p % PGSIZE;
+		vq_desc[d].len = len;
+		vq_desc[d].flags = VIRTQ_DESC_F_NEXT | (write ? 0 : VIRTQ_DESC_F_WRITE);
+		vq_desc[prev].next = d;
+		prev = d;
+	}
+	d = vq_alloc_desc();
+	vq_desc[d].addr = PADDR(&r->r_status);
+	vq_desc[d].len = 1;
+	vq_desc[d].flags = VIRTQ_DESC_F_WRITE;
+	vq_desc[prev].next = d;
+	vblk_head_req[r->r_head] = r - vblk_reqs;
+
+	// the device may look at the ring as soon as idx moves
+	vq_avail->ring[vq_avail->idx % vq_num] = r->r_head;
+	asm volatile("" : : : "memory");
+	vq_avail->idx++;
+	asm volatile("" : : : "memory");
+	outw(vblk_base + VIRTIO_QUEUE_NOTIFY, 0);
+
+	e->ide_async = 1;
+	return 0;
+}
+
+// Copy the tags of up to max of e's finished requests to tags, oldest
+// first.  Returns how many, or -E_NOT_SUPP if there's no virtio-blk
+// disk.
+int
+vblk_reap(struct Env *e, uint32_t *tags, int max)
+{
+	struct VblkReq *r;
+	int i, n = 0;
+
+	if (!vq_num)
+		return -E_NOT_SUPP;
+	if (max > 0)
+		user_mem_assert(e, tags, max * sizeof(uint32_t), PTE_U | PTE_W);
+
+	for (i = 0; i < vblk_ndone; i++) {
+		r = &vblk_reqs[vblk_done[i]];
+		if (n < max && r->r_env == e->env_id) {
+			tags[n++] = r->r_tag;
+			r->r_busy = 0;
+		} else
+			vblk_done[i - n] = vblk_done[i];
+	}
+	vblk_ndone -= n;
+	return n;
+}
+
+// Wake e for its finished requests.  It stays busy, as far as the
+// scheduler is concerned, while it has others in flight.
+static void
+vblk_wakeup(struct Env *e)
+{
+	struct VblkReq *r;
+
+	ide_wakeup(e);
+	for (r = vblk_reqs; r < vblk_reqs + VBLK_NREQ; r++)
+		if (r->r_busy && !r->r_done && r->r_env == e->env_id)
+			e->ide_async = 1;
+}
+
+// Move the requests the device has finished to vblk_done, and wake
+// their environments.
+void
+vblk_intr(void)
+{
+	struct VblkReq *r;
+	struct Env *e;
+	envid_t woken = 0;
+	uint16_t d;
+	int i;
+
+	inb(vblk_base + VIRTIO_ISR);
+	while (vq_last_used != vq_used->idx) {
+		d = vq_used->ring[vq_last_used % vq_num].id;
+		vq_last_used++;
+		r = &vblk_reqs[vblk_head_req[d]];
+
+		// give back the chain's descriptors, and the pages
+		while (1) {
+			uint16_t next = vq_desc[d].next;
+			bool more = vq_desc[d].flags & VIRTQ_DESC_F_NEXT;
+
+			vq_desc[d].next = vq_free;
+			vq_free = d;
+			vq_nfree++;
+			if (!more)
+				break;
+			d = next;
+		}
+		for (i = 0; i < r->r_npages; i++)
+			page_decref(r->r_pages[i]);
+		r->r_npages = 0;
+		if (r->r_status != 0)
+			cprintf("virtio-blk: %s of sector %d failed, status %d\n",
+				r->r_hdr.type == VIRTIO_BLK_T_OUT ? "write" : "read",
+				(uint32_t) r->r_hdr.sector, r->r_status);
+		r->r_done = 1;
+		vblk_done[vblk_ndone++] = r - vblk_reqs;
+		if (r->r_env != woken && envid2env(r->r_env, &e, 0) == 0)
+			vblk_wakeup(e);
+		woken = r->r_env;
+	}
+
+	outb(IO_PIC1, 0x20);
+	outb(IO_PIC2, 0x20);
+}
@@ -0,0 +1,22 @@
+#ifndef JOS_KERN_VIRTIO_H
+#define JOS_KERN_VIRTIO_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <kern/env.h>
+#include <kern/pci.h>
+
+#define VIRTIO_VENDOR_ID	0x1AF4
+#define VIRTIO_BLK_DEVICE_ID	0x1001	// legacy interface
+
+extern uint8_t vblk_irq;	// 0 if there's no virtio-blk disk
+
+int vblk_attach(struct pci_func *pcif);
+int vblk_submit(struct Env *e, uint32_t tag, uint32_t secno, void *va,
+		size_t nsecs, int op);
+int vblk_reap(struct Env *e, uint32_t *tags, int max);
+void vblk_intr(void);
+
+#endif	// !JOS_KERN_VIRTIO_H
@@ -6,14 +6,23 @@
 
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
+// Requests made from the page fault handler, which may run while
+// fsipcbuf is half filled in.
+static union Fsipc faultipcbuf __attribute__((aligned(PGSIZE)));
+
 // Send an inter-environment request to the file server, and wait for
-// a reply.  The request body should be in fsipcbuf, and parts of the
-// response may be written back to fsipcbuf.
+// a reply.  The request body should be in 'req', and parts of the
+// response may be written back to 'req'.  The 'npages' - 1 pages
+// after 'req' go along with it, for FSREQ_READ_PAGES and
+// FSREQ_WRITE_PAGES.
 // type: request code, passed as the simple integer IPC value.
 // dstva: virtual address at which to receive reply page, 0 if none.
+// perm_store: if not null, set to the reply page's permissions, 0 if
+// no page came back.
 // Returns result from the file server.
 static int
-fsipc(unsigned type, void *dstva)
+fsipc_pages(unsigned type, union Fsipc *req, size_t npages, void *dstva,
+	    int *perm_store)
 {
 	static envid_t fsenv;
 	if (fsenv == 0)
@@ -22,10 +31,148 @@ fsipc(unsigned type, void *dstva)
 	static_assert(sizeof(fsipcbuf) == PGSIZE);
 
 	if (debug)
-		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
+		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)req);
+
+	if (npages == 1)
+		ipc_send(fsenv, type, req, PTE_P | PTE_W | PTE_U);
+	else
+		ipc_send_pages(fsenv, type, req, PTE_P | PTE_W | PTE_U, npages);
+	return ipc_recv(NULL, dstva, perm_store);
+}
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
-	return ipc_recv(NULL, dstva, NULL);
+// Same, with the request page alone.
+static int
+fsipc_req(unsigned type, union Fsipc *req, void *dstva)
+{
+	return fsipc_pages(type, req, 1, dstva, NULL);
+}
+
+// Same, with the request in fsipcbuf.
+static int
+fsipc(unsigned type, void *dstva)
+{
+	return fsipc_req(type, &fsipcbuf, dstva);
+}
+
+// Reads and writes of more than a page go through FSIPCVA, just below
+// the mmap() regions: a request page followed by up to FSIPC_MAXPAGES
+// data pages, all sent to the file server in one IPC so that it reads
+// or writes the data in place.
+#define FSIPCVA		0x1ff00000
+#define fsipcpages	((union Fsipc *) FSIPCVA)
+
+// Make the first 'npages' pages at FSIPCVA private and writable, as
+// pages sent for the server to write into must be.  Copy-on-write
+// pages left by fork are simply replaced, their contents don't matter.
+static int
+fsipc_window(size_t npages)
+{
+	uintptr_t va;
+	int r;
+
+	for (va = FSIPCVA; va < FSIPCVA + npages * PGSIZE; va += PGSIZE)
+		if (!(uvpd[PDX(va)] & PTE_P) || !(uvpt[PGNUM(va)] & PTE_W))
+			if ((r = sys_page_alloc(0, (void *) va, PTE_P | PTE_U | PTE_W)) < 0)
+				return r;
+	return 0;
+}
+
+// An optional per-process cache, turned on by fcache_enable(), of pages
+// of files read and of their stat results.  Each entry carries the
+// file's version (see FSREQ_VERSIONS) from before it was fetched and is
+// good until that changes, so using it takes no IPC at all.  Reads of
+// more than a page bypass it.
+#define FCACHEVA	0x1fe00000
+#define FVERSVA		(FCACHEVA - PGSIZE)
+#define FC_NPAGE	16
+#define FC_NSTAT	8
+#define FCPAGE(i)	((char *) FCACHEVA + (i) * PGSIZE)
+
+struct FcPage {
+	uint32_t fc_inum;	// 0 if the slot is free
+	uint32_t fc_pageno;
+	uint32_t fc_vers;
+	int fc_len;		// bytes of the file in the page
+};
+
+struct FcStat {
+	uint32_t fc_inum;	// 0 if the slot is free
+	uint32_t fc_vers;
+	char fc_name[MAXNAMELEN];
+	off_t fc_size;
+	int fc_isdir;
+};
+
+static volatile uint32_t *fcache_vers;	// NULL while the cache is off
+static struct FcPage fcpages[FC_NPAGE];
+static struct FcStat fcstats[FC_NSTAT];
+static int fcpage_next;			// next page slot to replace
+
+// Turn this process's file cache on.  Returns 0, or < 0 on error.
+int
+fcache_enable(void)
+{
+	int r;
+
+	if (fcache_vers)
+		return 0;
+	if ((r = fsipc(FSREQ_VERSIONS, (void *) FVERSVA)) < 0)
+		return r;
+	fcache_vers = (volatile uint32_t *) FVERSVA;
+	return 0;
+}
+
+static uint32_t
+fcache_version(struct Fd *fd)
+{
+	return fcache_vers[fd->fd_file.inum % FS_NVERS];
+}
+
+// Read up to n bytes, no further than the end of the page, at the seek
+// position of fd from the cache, fetching the whole page into it first
+// if it isn't there.  Returns like devfile_read.
+static ssize_t
+fcache_read(struct Fd *fd, void *buf, size_t n)
+{
+	uint32_t vers = fcache_version(fd), pageno = fd->fd_offset / PGSIZE;
+	off_t off = fd->fd_offset;
+	struct FcPage *p;
+	char *pg;
+	int i, r;
+
+	for (i = 0; i < FC_NPAGE; i++)
+		if (fcpages[i].fc_inum == fd->fd_file.inum
+		    && fcpages[i].fc_pageno == pageno && fcpages[i].fc_vers == vers)
+			break;
+	if (i == FC_NPAGE) {
+		i = fcpage_next;
+		fcpage_next = (fcpage_next + 1) % FC_NPAGE;
+		p = &fcpages[i];
+		pg = FCPAGE(i);
+		p->fc_inum = 0;
+		if (!(uvpd[PDX(pg)] & PTE_P) || !(uvpt[PGNUM(pg)] & PTE_P))
+			if ((r = sys_page_alloc(0, pg, PTE_P | PTE_U | PTE_W)) < 0)
+				return r;
+
+		fd->fd_offset = pageno * PGSIZE;
+		fsipcbuf.read.req_fileid = fd->fd_file.id;
+		fsipcbuf.read.req_n = PGSIZE;
+		r = fsipc(FSREQ_READ, NULL);
+		fd->fd_offset = off;
+		if (r < 0)
+			return r;
+		memmove(pg, fsipcbuf.readRet.ret_buf, r);
+		p->fc_inum = fd->fd_file.inum;
+		p->fc_pageno = pageno;
+		p->fc_vers = vers;
+		p->fc_len = r;
+	}
+
+	r = MAX(fcpages[i].fc_len - (int) (off % PGSIZE), 0);
+	r = MIN((size_t) r, n);
+	memmove(buf, FCPAGE(i) + off % PGSIZE, r);
+	fd->fd_offset = off + r;
+	return r;
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -115,12 +262,46 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 	// filling fsipcbuf.read with the request arguments.  The
 	// bytes read will be written back to fsipcbuf by the file
 	// system server.
-	int r;
+	int r, perm;
+	size_t npages;
+
+	if (fcache_vers && fd->fd_file.inum && n <= PGSIZE)
+		return fcache_read(fd, buf, n);
 
-	fsipcbuf.read.req_fileid = fd->fd_file.id;
-	fsipcbuf.read.req_n = n;
-	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
+	// A whole page of buffer can take the file server's block cache
+	// page itself, copy-on-write, instead of a copy of it, which beats
+	// even a many-page read.  Not if the page carries PTE_AVAIL bits
+	// (malloc's, PTE_SHARE) that the new mapping would lose.
+	if (n >= PGSIZE && PGOFF(buf) == 0 && (uintptr_t) buf < UTOP
+	    && (uvpd[PDX(buf)] & PTE_P) && !(uvpt[PGNUM(buf)] & PTE_AVAIL)
+	    && cow_enable()) {
+		fsipcbuf.read_map.req_fileid = fd->fd_file.id;
+		fsipcbuf.read_map.req_n = n;
+		if ((r = fsipc_pages(FSREQ_READ_MAP, &fsipcbuf, 1, buf, &perm)) < 0
+		    || perm)
+			return r;
+		// no page came back: the server fell back to an ordinary
+		// read, which may still have read a whole page
+	} else if (n > PGSIZE) {
+		// More than a page moves through the FSIPCVA window, many
+		// pages for one request.
+		npages = MIN(ROUNDUP(n, PGSIZE) / PGSIZE, FSIPC_MAXPAGES);
+		n = MIN(n, npages * PGSIZE);
+		if ((r = fsipc_window(1 + npages)) < 0)
+			return r;
+		fsipcpages->pages.req_fileid = fd->fd_file.id;
+		fsipcpages->pages.req_n = n;
+		if ((r = fsipc_pages(FSREQ_READ_PAGES, fsipcpages, 1 + npages, NULL, NULL)) < 0)
+			return r;
+		assert(r <= n);
+		memmove(buf, (char *) fsipcpages + PGSIZE, r);
 		return r;
+	} else {
+		fsipcbuf.read.req_fileid = fd->fd_file.id;
+		fsipcbuf.read.req_n = n;
+		if ((r = fsipc(FSREQ_READ, NULL)) < 0)
+			return r;
+	}
 	assert(r <= n);
 	assert(r <= PGSIZE);
 	memmove(buf, fsipcbuf.readRet.ret_buf, r);
@@ -142,6 +323,23 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	// bytes than requested.
 	// LAB 5: Your code here
 	int r;
+	size_t npages;
+
+	// More than fits in the request page goes through the FSIPCVA
+	// window, as in devfile_read.
+	if (n > sizeof(fsipcbuf.write.req_buf)) {
+		npages = MIN(ROUNDUP(n, PGSIZE) / PGSIZE, FSIPC_MAXPAGES);
+		n = MIN(n, npages * PGSIZE);
+		if ((r = fsipc_window(1 + npages)) < 0)
+			return r;
+		fsipcpages->pages.req_fileid = fd->fd_file.id;
+		fsipcpages->pages.req_n = n;
+		memmove((char *) fsipcpages + PGSIZE, buf, n);
+		if ((r = fsipc_pages(FSREQ_WRITE_PAGES, fsipcpages, 1 + npages, NULL, NULL)) < 0)
+			return r;
+		assert(r <= n);
+		return r;
+	}
 
 	fsipcbuf.write.req_fileid = fd->fd_file.id;
 	fsipcbuf.write.req_n = n;
@@ -157,14 +355,35 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 static int
 devfile_stat(struct Fd *fd, struct Stat *st)
 {
+	struct FcStat *c = NULL;
+	uint32_t vers = 0;
 	int r;
 
+	if (fcache_vers && fd->fd_file.inum) {
+		vers = fcache_version(fd);
+		c = &fcstats[fd->fd_file.inum % FC_NSTAT];
+		if (c->fc_inum == fd->fd_file.inum && c->fc_vers == vers) {
+			strcpy(st->st_name, c->fc_name);
+			st->st_size = c->fc_size;
+			st->st_isdir = c->fc_isdir;
+			return 0;
+		}
+	}
+
 	fsipcbuf.stat.req_fileid = fd->fd_file.id;
 	if ((r = fsipc(FSREQ_STAT, NULL)) < 0)
 		return r;
 	strcpy(st->st_name, fsipcbuf.statRet.ret_name);
 	st->st_size = fsipcbuf.statRet.ret_size;
 	st->st_isdir = fsipcbuf.statRet.ret_isdir;
+
+	if (c) {
+		c->fc_inum = fd->fd_file.inum;
+		c->fc_vers = vers;
+		strcpy(c->fc_name, st->st_name);
+		c->fc_size = st->st_size;
+		c->fc_isdir = st->st_isdir;
+	}
 	return 0;
 }
 
@@ -188,3 +407,226 @@ sync(void)
 	return fsipc(FSREQ_SYNC, NULL);
 }
 
+// Fetch the file server's block cache statistics
+int
+bcstat(struct BcStats *st)
+{
+	int r;
+
+	if ((r = fsipc(FSREQ_BCSTAT, NULL)) < 0)
+		return r;
+	memmove(st, &fsipcbuf, sizeof(*st));
+	return 0;
+}
+
+// Have the file server keep the directory at path, made if there is
+// none, in RAM: a tmpfs, which starts out empty and is gone after a
+// reboot.
+int
+mount_tmpfs(const char *path)
+{
+	if (strlen(path) >= MAXPATHLEN)
+		return -E_BAD_PATH;
+	strcpy(fsipcbuf.tmpfs.req_path, path);
+	return fsipc(FSREQ_TMPFS, NULL);
+}
+
+// Read the file at path into buf, at most max bytes of it, with
+// compound requests that open, stat, read and close it all at once:
+// just one, if it fits in the request's data pages.  Returns the
+// file's size, which is more than max if it didn't all fit, or < 0
+// on error; -E_INVAL if path is a directory.
+int
+read_whole_file(const char *path, void *buf, size_t max)
+{
+	union Fsipc *req;
+	struct Fsop *op;
+	size_t off = 0, n, npages;
+	int r, size;
+
+	if (strlen(path) >= MAXPATHLEN)
+		return -E_BAD_PATH;
+	do {
+		n = MIN(max - off, FSIPC_MAXPAGES * PGSIZE);
+		if (n <= sizeof(fsipcbuf.compoundRet.ret_buf)) {
+			req = &fsipcbuf;
+			npages = 1;
+		} else {
+			req = fsipcpages;
+			npages = 1 + ROUNDUP(n, PGSIZE) / PGSIZE;
+			if ((r = fsipc_window(npages)) < 0)
+				return r;
+		}
+		strcpy(req->compound.req_path, path);
+		op = req->compound.req_ops;
+		*op++ = (struct Fsop) { FSOP_OPEN, 0 };
+		*op++ = (struct Fsop) { FSOP_STAT, 0 };
+		*op++ = (struct Fsop) { FSOP_SEEK, off };
+		*op++ = (struct Fsop) { FSOP_READ, n };
+		*op++ = (struct Fsop) { FSOP_CLOSE, 0 };
+		req->compound.req_nops = op - req->compound.req_ops;
+		if ((r = fsipc_pages(FSREQ_COMPOUND, req, npages, NULL, NULL)) < 0)
+			return r;
+
+		if (req->compoundRet.ret_isdir)
+			return -E_INVAL;
+		size = req->compoundRet.ret_size;
+		r = req->compoundRet.ret_r[3];		// the FSOP_READ
+		memmove((char *) buf + off, npages == 1 ? req->compoundRet.ret_buf
+			: (char *) req + PGSIZE, r);
+		off += r;
+	} while (r > 0 && off < max && off < size);
+	return size;
+}
+
+
+// mmap()ed regions live between MMAPBASE and MMAPEND.  Each one keeps
+// its file open by holding a reference to the Fd page, mapped at
+// MMAPFD(i), and pages are fetched from the file server by the page
+// fault handler when first touched.
+#define MAXMMAP		32
+#define MMAPBASE	0x20000000
+#define MMAPEND		0x40000000
+#define MMAPFD(i)	((struct Fd *) (MMAPBASE + (i) * PGSIZE))
+#define MMAPVA		(MMAPBASE + MAXMMAP * PGSIZE)
+
+struct Mmap {
+	uintptr_t m_va;		// 0 if the slot is free
+	size_t m_len;
+	off_t m_offset;		// file offset mapped at m_va
+	int m_prot;
+	int m_flags;
+};
+
+static struct Mmap mmaps[MAXMMAP];
+
+static struct Mmap *
+mmap_lookup(uintptr_t va)
+{
+	int i;
+
+	for (i = 0; i < MAXMMAP; i++)
+		if (mmaps[i].m_va && mmaps[i].m_va <= va
+		    && va < mmaps[i].m_va + mmaps[i].m_len)
+			return &mmaps[i];
+	return NULL;
+}
+
+// Find 'len' bytes of address space in the mmap region.
+static uintptr_t
+mmap_findva(size_t len)
+{
+	uintptr_t va = MMAPVA;
+	int i;
+
+again:
+	if (va + len > MMAPEND)
+		return 0;
+	for (i = 0; i < MAXMMAP; i++)
+		if (mmaps[i].m_va && va < mmaps[i].m_va + mmaps[i].m_len
+		    && mmaps[i].m_va < va + len) {
+			va = mmaps[i].m_va + mmaps[i].m_len;
+			goto again;
+		}
+	return va;
+}
+
+// Map 'len' bytes of open file 'fdnum', starting at page-aligned
+// 'offset', into memory.  MAP_SHARED mappings are read-only and see
+// later changes to the file; MAP_PRIVATE mappings are copy-on-write.
+// Touching a page past the end of the file is a fault.
+//
+// Returns the address of the mapping, or NULL on error.
+void *
+mmap(int fdnum, off_t offset, size_t len, int prot, int flags)
+{
+	struct Fd *fd;
+	uintptr_t va;
+	int i;
+
+	if (fd_lookup(fdnum, &fd) < 0 || fd->fd_dev_id != devfile.dev_id)
+		return NULL;
+	if (len == 0 || offset < 0 || PGOFF(offset) || !(prot & PROT_READ)
+	    || (fd->fd_omode & O_ACCMODE) == O_WRONLY)
+		return NULL;
+	if ((flags != MAP_SHARED && flags != MAP_PRIVATE)
+	    || (flags == MAP_SHARED && (prot & PROT_WRITE)))
+		return NULL;
+	// the page fault handler does the work
+	if (!cow_enable())
+		return NULL;
+
+	len = ROUNDUP(len, PGSIZE);
+	for (i = 0; i < MAXMMAP && mmaps[i].m_va; i++)
+		;
+	if (i == MAXMMAP || (va = mmap_findva(len)) == 0)
+		return NULL;
+	if (sys_page_map(0, fd, 0, MMAPFD(i), PTE_P|PTE_U) < 0)
+		return NULL;
+
+	mmaps[i].m_va = va;
+	mmaps[i].m_len = len;
+	mmaps[i].m_offset = offset;
+	mmaps[i].m_prot = prot;
+	mmaps[i].m_flags = flags;
+	return (void *) va;
+}
+
+// Unmap [addr, addr + len), which must be the start, the end or the
+// whole of a region returned by mmap().
+int
+munmap(void *addr, size_t len)
+{
+	uintptr_t va = (uintptr_t) addr;
+	struct Mmap *m;
+	size_t i;
+
+	len = ROUNDUP(len, PGSIZE);
+	if (PGOFF(va) || len == 0 || (m = mmap_lookup(va)) == NULL
+	    || va + len > m->m_va + m->m_len
+	    || (va != m->m_va && va + len != m->m_va + m->m_len))
+		return -E_INVAL;
+
+	for (i = 0; i < len; i += PGSIZE)
+		sys_page_unmap(0, (void *) (va + i));
+
+	if (len == m->m_len) {
+		// a close, as far as the file server is concerned
+		devfile_flush(MMAPFD(m - mmaps));
+		sys_page_unmap(0, MMAPFD(m - mmaps));
+		m->m_va = 0;
+	} else if (va == m->m_va) {
+		m->m_va += len;
+		m->m_offset += len;
+		m->m_len -= len;
+	} else
+		m->m_len -= len;
+	return 0;
+}
+
+// Called by the page fault handler.  If 'addr' is an untouched page
+// of an mmap()ed region, fetch it from the file server.
+//
+// Returns 0 if the fault was handled, < 0 if it is not ours.
+int
+mmap_pgfault(void *addr)
+{
+	uintptr_t va = ROUNDDOWN((uintptr_t) addr, PGSIZE);
+	struct Mmap *m;
+	int r;
+
+	if (va < MMAPVA || va >= MMAPEND || (m = mmap_lookup(va)) == NULL
+	    || ((uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P)))
+		return -E_INVAL;
+
+	faultipcbuf.map.req_fileid = MMAPFD(m - mmaps)->fd_file.id;
+	faultipcbuf.map.req_offset = m->m_offset + (va - m->m_va);
+	faultipcbuf.map.req_cow = (m->m_flags == MAP_PRIVATE);
+	if ((r = fsipc_req(FSREQ_MAP, &faultipcbuf, (void *) va)) < 0)
+		panic("mmap fault at %08x: %e", addr, r);
+	// a private mapping that isn't writable must not look copy-on-write
+	if (m->m_flags == MAP_PRIVATE && !(m->m_prot & PROT_WRITE)
+	    && (r = sys_page_map(0, (void *) va, 0, (void *) va, PTE_P|PTE_U)) < 0)
+		panic("mmap fault at %08x: %e", addr, r);
+	return 0;
+}
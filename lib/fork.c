@@ -3,10 +3,6 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
-
 //
 // Custom page fault handler - if faulting page is copy-on-write,
 // map in our own private writable copy.
@@ -24,6 +20,10 @@ pgfault(struct UTrapframe *utf)
 	//   Use the read-only page table mappings at uvpt
 	//   (see <inc/memlayout.h>).
 
+	// Untouched pages of mmap()ed files are fetched on demand.
+	if (mmap_pgfault(addr) == 0)
+		return;
+
 	// LAB 4: Your code here.
 	if ((err & FEC_WR) != FEC_WR)
 	{
@@ -55,6 +55,23 @@ pgfault(struct UTrapframe *utf)
 		panic("sys_page_unmap, %e", r);
 }
 
+//
+// Make sure this environment handles copy-on-write faults, so that
+// copy-on-write pages can be handed to it (see devfile_read).
+// Returns 0 if it already has a page fault handler of its own.
+//
+bool
+cow_enable(void)
+{
+	extern void (*_pgfault_handler)(struct UTrapframe *utf);
+
+	if (_pgfault_handler != NULL && _pgfault_handler != pgfault)
+		return 0;
+	if (_pgfault_handler == NULL)
+		set_pgfault_handler(pgfault);
+	return 1;
+}
+
 //
 // Map our virtual page pn (address pn*PGSIZE) into the target envid
 // at the same virtual address.  If the page is writable or copy-on-write,
@@ -155,6 +172,12 @@ fork(void)
 		{
 			duppage(child, PGNUM(addr));
 		}
+		else if ((uvpd[PDX(addr)] & PTE_P) == PTE_P && (uvpt[PGNUM(addr)] & PTE_DZ) == PTE_DZ)
+		{
+			// untouched demand-zero page, the child gets its own reservation
+			if ((r = sys_page_reserve(child, addr, PGSIZE, PTE_P | (uvpt[PGNUM(addr)] & PTE_SYSCALL))) != 0)
+				panic("sys_page_reserve, %e", r);
+		}
 	}
 
 	// Start the child environment running
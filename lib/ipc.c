@@ -65,6 +65,43 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 	}
 }
 
+// Send 'val' and the 'npages' pages from 'pg' on to 'toenv', which
+// maps as many of them as it asked for in ipc_recv_pages.
+void
+ipc_send_pages(envid_t to_env, uint32_t val, void *pg, int perm, size_t npages)
+{
+	int r;
+
+	while ((r = sys_ipc_send_pages(to_env, val, pg, perm, npages)) != 0) {
+		if (r != -E_IPC_NOT_RECV)
+			panic("sys_ipc_send_pages, %e", r);
+		sys_yield();
+	}
+}
+
+// Like ipc_recv, but take up to *npages pages at 'pg' from a sender
+// using ipc_send_pages, and store in *npages how many came.
+int32_t
+ipc_recv_pages(envid_t *from_env_store, void *pg, size_t *npages, int *perm_store)
+{
+	int r;
+
+	if ((r = sys_ipc_recv_pages(pg, *npages)) != 0) {
+		if (from_env_store)
+			*from_env_store = 0;
+		if (perm_store)
+			*perm_store = 0;
+		*npages = 0;
+		return r;
+	}
+	if (from_env_store)
+		*from_env_store = thisenv->env_ipc_from;
+	if (perm_store)
+		*perm_store = thisenv->env_ipc_perm;
+	*npages = thisenv->env_ipc_npages;
+	return thisenv->env_ipc_value;
+}
+
 // Find the first environment of the given type.  We'll use this to
 // find special environments.
 // Returns 0 if no such environment exists.
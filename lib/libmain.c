@@ -3,7 +3,8 @@
 
 #include <inc/lib.h>
 
-extern void umain(int argc, char **argv);
+// Set by entry.S to the program's umain before libmain is called.
+void (*libmain_umain)(int argc, char **argv);
 
 const volatile struct Env *thisenv;
 const char *binaryname = "<unknown>";
@@ -21,7 +22,7 @@ libmain(int argc, char **argv)
 		binaryname = argv[0];
 
 	// call user main routine
-	umain(argc, argv);
+	libmain_umain(argc, argv);
 
 	// exit gracefully
 	exit();
@@ -14,6 +14,9 @@
  * If we need to allocate a large amount (more than a page)
  * we can't put a ref count at the end of each page,
  * so we mark the pte entry with the bit PTE_CONTINUED.
+ *
+ * Chunks are reserved demand-zero (sys_page_reserve), so a large
+ * buffer only costs physical pages for the parts actually touched.
  */
 enum
 {
@@ -33,7 +36,7 @@ isfree(void *v, size_t n)
 
 	for (va = (uintptr_t) v; va < end_va; va += PGSIZE)
 		if (va >= (uintptr_t) mend
-		    || ((uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P)))
+		    || ((uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & (PTE_P|PTE_DZ))))
 			return 0;
 	return 1;
 }
@@ -41,7 +44,7 @@ isfree(void *v, size_t n)
 void*
 malloc(size_t n)
 {
-	int i, cont;
+	size_t len;
 	int nwrap;
 	uint32_t *ref;
 	void *v;
@@ -93,18 +96,19 @@ malloc(size_t n)
 	}
 
 	/*
-	 * allocate at mptr - the +4 makes sure we allocate a ref count.
+	 * reserve at mptr - the +4 makes sure we reserve a ref count.
+	 * every page but the last is flagged PTE_CONTINUED.
 	 */
-	for (i = 0; i < n + 4; i += PGSIZE){
-		cont = (i + PGSIZE < n + 4) ? PTE_CONTINUED : 0;
-		if (sys_page_alloc(0, mptr + i, PTE_P|PTE_U|PTE_W|cont) < 0){
-			for (; i >= 0; i -= PGSIZE)
-				sys_page_unmap(0, mptr + i);
-			return 0;	/* out of physical memory */
-		}
+	len = ROUNDUP(n + 4, PGSIZE);
+	if ((len > PGSIZE
+	     && sys_page_reserve(0, mptr, len - PGSIZE, PTE_P|PTE_U|PTE_W|PTE_CONTINUED) < 0)
+	    || sys_page_reserve(0, mptr + len - PGSIZE, PGSIZE, PTE_P|PTE_U|PTE_W) < 0) {
+		for (v = mptr; v < (void *) (mptr + len); v += PGSIZE)
+			sys_page_unmap(0, v);
+		return 0;	/* out of memory for page tables */
 	}
 
-	ref = (uint32_t*) (mptr + i - 4);
+	ref = (uint32_t*) (mptr + len - 4);
 	*ref = 2;	/* reference for mptr, reference for returned block */
 	v = mptr;
 	mptr += n;
@@ -10,6 +10,7 @@ static int init_stack(envid_t child, const char **argv, uintptr_t *init_esp);
 static int map_segment(envid_t child, uintptr_t va, size_t memsz,
 		       int fd, size_t filesz, off_t fileoffset, int perm);
 static int copy_shared_pages(envid_t child);
+static int map_interp(envid_t child, int fd, struct Proghdr *ph);
 
 /****
 Think about what you would have to do in order to implement exec in user space,
@@ -126,6 +127,12 @@ spawn(const char *prog, const char **argv)
 	// Set up program segments as defined in ELF header.
 	ph = (struct Proghdr*) (elf_buf + elf->e_phoff);
 	for (i = 0; i < elf->e_phnum; i++, ph++) {
+		if (ph->p_type == ELF_PROG_INTERP) {
+			// Program runs on the shared libjos image
+			if ((r = map_interp(child, fd, ph)) < 0)
+				goto error;
+			continue;
+		}
 		if (ph->p_type != ELF_PROG_LOAD)
 			continue;
 		perm = PTE_P | PTE_U;
@@ -291,9 +298,11 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 
 	for (i = 0; i < memsz; i += PGSIZE) {
 		if (i >= filesz) {
-			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
+			// the rest of the segment is blank, leave it demand-zero
+			if ((r = sys_page_reserve(child, (void*) (va + i),
+						  ROUNDUP(memsz, PGSIZE) - i, perm)) < 0)
 				return r;
+			break;
 		} else {
 			// from file
 			if ((r = sys_page_alloc(0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
@@ -302,6 +311,17 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 				return r;
 			if ((r = readn(fd, UTEMP, MIN(PGSIZE, filesz-i))) < 0)
 				return r;
+			// a whole page read may have mapped the fs server's
+			// block read-only in its place (see devfile_read); a
+			// writable segment needs a copy of its own
+			if ((perm & PTE_W) && !(uvpt[PGNUM(UTEMP)] & PTE_W)) {
+				if ((r = sys_page_alloc(0, UTEMP2, PTE_P|PTE_U|PTE_W)) < 0)
+					return r;
+				memmove(UTEMP2, UTEMP, PGSIZE);
+				if ((r = sys_page_map(0, UTEMP2, 0, UTEMP, PTE_P|PTE_U|PTE_W)) < 0)
+					return r;
+				sys_page_unmap(0, UTEMP2);
+			}
 			if ((r = sys_page_map(0, UTEMP, child, (void*) (va + i), perm)) < 0)
 				panic("spawn: sys_page_map data: %e", r);
 			sys_page_unmap(0, UTEMP);
@@ -310,6 +330,70 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 	return 0;
 }
 
+// Map the pages of our own segment [va, va+memsz) into the child at the
+// same address, read-only.
+static int
+share_segment(envid_t child, uintptr_t va, size_t memsz)
+{
+	uintptr_t end = va + memsz;
+	int r;
+
+	for (va = ROUNDDOWN(va, PGSIZE); va < end; va += PGSIZE)
+		if ((r = sys_page_map(0, (void*) va, child, (void*) va, PTE_P|PTE_U)) < 0)
+			return r;
+	return 0;
+}
+
+// Map the shared libjos image named by the program's PT_INTERP header
+// 'ph' into the child.  If we are running on the image ourselves, its
+// text is already mapped here and is shared with the child rather than
+// read again; its data is always loaded fresh from the image.
+static int
+map_interp(envid_t child, int progfd, struct Proghdr *ph)
+{
+	unsigned char elf_buf[512];
+	char path[MAXNAMELEN];
+	struct Elf *elf;
+	int fd, i, r, perm;
+
+	if (ph->p_filesz >= sizeof(path))
+		return -E_BAD_PATH;
+	if ((r = seek(progfd, ph->p_offset)) < 0
+	    || (r = readn(progfd, path, ph->p_filesz)) != ph->p_filesz)
+		return r < 0 ? r : -E_NOT_EXEC;
+	path[ph->p_filesz] = '\0';
+
+	if ((r = open(path, O_RDONLY)) < 0)
+		return r;
+	fd = r;
+
+	elf = (struct Elf*) elf_buf;
+	if (readn(fd, elf_buf, sizeof(elf_buf)) != sizeof(elf_buf)
+	    || elf->e_magic != ELF_MAGIC) {
+		close(fd);
+		return -E_NOT_EXEC;
+	}
+
+	r = 0;
+	ph = (struct Proghdr*) (elf_buf + elf->e_phoff);
+	for (i = 0; i < elf->e_phnum && r >= 0; i++, ph++) {
+		if (ph->p_type != ELF_PROG_LOAD)
+			continue;
+		perm = PTE_P | PTE_U;
+		if (ph->p_flags & ELF_PROG_FLAG_WRITE)
+			perm |= PTE_W;
+		else if (ph->p_va <= (uintptr_t) spawn
+			 && (uintptr_t) spawn < ph->p_va + ph->p_memsz) {
+			r = share_segment(child, ph->p_va, ph->p_memsz);
+			continue;
+		}
+		r = map_segment(child, ph->p_va, ph->p_memsz,
+				fd, ph->p_filesz, ph->p_offset, perm);
+	}
+	close(fd);
+	return r;
+}
+
 // Copy the mappings for shared pages into the child address space.
 static int
 copy_shared_pages(envid_t child)
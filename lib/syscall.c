@@ -125,6 +125,12 @@ sys_page_unmap(envid_t envid, void *va)
 	return sysenter(SYS_page_unmap, envid, (uint32_t) va, 0, 0);
 }
 
+int
+sys_page_reserve(envid_t envid, void *va, size_t len, int perm)
+{
+	return sysenter(SYS_page_reserve, envid, (uint32_t) va, len, perm);
+}
+
 // sys_exofork is inlined in lib.h
 
 int
@@ -151,6 +157,13 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 	return sysenter(SYS_ipc_try_send, envid, value, (uint32_t) srcva, perm);
 }
 
+int
+sys_ipc_send_pages(envid_t envid, uint32_t value, void *srcva, int perm, size_t npages)
+{
+	// sysenter has no room for the fifth argument
+	return syscall(SYS_ipc_send_pages, 0, envid, value, (uint32_t) srcva, perm, npages);
+}
+
 int
 sys_ipc_recv(void *dstva)
 {
@@ -158,17 +171,41 @@ sys_ipc_recv(void *dstva)
 	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, 0, 0, 0, 0);
 }
 
+int
+sys_ipc_recv_pages(void *dstva, size_t npages)
+{
+	return syscall(SYS_ipc_recv, 1, (uint32_t)dstva, npages, 0, 0, 0);
+}
+
 unsigned int
 sys_time_msec(void)
 {
 	return (unsigned int) syscall(SYS_time_msec, 0, 0, 0, 0, 0, 0);
 }
 
-void
+int
+sys_sleep(unsigned int msec)
+{
+	return syscall(SYS_sleep, 0, msec, 0, 0, 0, 0);
+}
+
+int
 sys_ide_sleep(void *chan, size_t nsecs, int op)
 {
 	// can't use sysenter, since we need to restore our flags from trapframe
-	syscall(SYS_ide_sleep, 0, (uint32_t)chan, nsecs, (uint32_t)op, 0, 0);
+	return syscall(SYS_ide_sleep, 0, (uint32_t)chan, nsecs, (uint32_t)op, 0, 0);
+}
+
+int
+sys_vblk_submit(uint32_t tag, uint32_t secno, void *va, size_t nsecs, int op)
+{
+	return syscall(SYS_vblk_submit, 0, tag, secno, (uint32_t)va, nsecs, op);
+}
+
+int
+sys_vblk_reap(uint32_t *tags, int max)
+{
+	return syscall(SYS_vblk_reap, 0, (uint32_t)tags, max, 0, 0, 0);
 }
 
 int 
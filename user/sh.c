@@ -293,6 +293,8 @@ umain(int argc, char **argv)
 
 	if (argc > 2)
 		usage();
+	// scripts are read a character at a time: keep them in the cache
+	fcache_enable();
 	if (argc == 2) {
 		close(0);
 		if ((r = open(argv[1], O_RDONLY)) < 0)
@@ -0,0 +1,61 @@
+// block allocator benchmark: how fast files grow, and how many disk
+// writes it then takes to write them out (one per run of consecutive
+// blocks, so fewer writes means less fragmentation)
+
+#include <inc/lib.h>
+
+#define NFILE	4
+#define NBLK	32
+
+char buf[BLKSIZE];
+
+static void
+grow(const char *what, int interleave)
+{
+	int fd[NFILE], i, b, r;
+	char path[16] = "/alloc0";
+	struct BcStats st0, st1;
+	uint32_t t0, t1;
+
+	if ((r = sync()) < 0 || (r = bcstat(&st0)) < 0)
+		panic("sync/bcstat: %e", r);
+	for (i = 0; i < NFILE; i++) {
+		path[6] = '0' + i;
+		if ((fd[i] = open(path, O_RDWR|O_CREAT|O_TRUNC)) < 0)
+			panic("open %s: %e", path, fd[i]);
+	}
+
+	t0 = sys_time_msec();
+	if (interleave) {
+		for (b = 0; b < NBLK; b++)
+			for (i = 0; i < NFILE; i++)
+				if ((r = write(fd[i], buf, BLKSIZE)) != BLKSIZE)
+					panic("write: %e", r);
+	} else {
+		for (i = 0; i < NFILE; i++)
+			for (b = 0; b < NBLK; b++)
+				if ((r = write(fd[i], buf, BLKSIZE)) != BLKSIZE)
+					panic("write: %e", r);
+	}
+	t1 = sys_time_msec();
+
+	if ((r = sync()) < 0 || (r = bcstat(&st1)) < 0)
+		panic("sync/bcstat: %e", r);
+	for (i = 0; i < NFILE; i++)
+		close(fd[i]);
+	cprintf("%s: %d blocks in %d msec, %d blocks in %d disk writes\n",
+		what, NFILE * NBLK, t1 - t0,
+		st1.bc_written - st0.bc_written, st1.bc_writes - st0.bc_writes);
+}
+
+void
+umain(int argc, char **argv)
+{
+	memset(buf, 'a', sizeof(buf));
+	grow("sequential", 0);
+	grow("interleaved", 1);
+
+	// truncating frees the blocks again
+	grow("sequential again", 0);
+	cprintf("block allocator benchmark done\n");
+}
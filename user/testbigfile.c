@@ -0,0 +1,74 @@
+// test files beyond the reach of the single indirect block, written
+// sparsely so they fit on a small disk
+
+#include <inc/lib.h>
+
+#define IND	(NDIRECT + NINDIRECT)	// first double-indirect block
+
+static off_t offsets[] = {
+	(IND - 1) * BLKSIZE,			// last indirect block
+	IND * BLKSIZE,				// first double-indirect block
+	(IND + NINDIRECT) * BLKSIZE,		// under the second indirect block
+	300 * 1024 * 1024,			// hundreds of megabytes in
+	MAXFILESIZE - BLKSIZE,			// the very last block
+};
+
+char buf[BLKSIZE];
+
+static void
+fill(int i)
+{
+	memset(buf, 'a' + i, BLKSIZE);
+	snprintf(buf, BLKSIZE, "block at %08x", offsets[i]);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int fd, i, r;
+	char got[BLKSIZE];
+	struct Stat st;
+
+	if ((fd = open("/bigfile", O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open /bigfile: %e", fd);
+
+	for (i = 0; i < ARRAY_SIZE(offsets); i++) {
+		fill(i);
+		seek(fd, offsets[i]);
+		if ((r = write(fd, buf, BLKSIZE)) != BLKSIZE)
+			panic("write at %08x: %e", offsets[i], r);
+	}
+	if ((r = fstat(fd, &st)) < 0)
+		panic("fstat: %e", r);
+	if (st.st_size != MAXFILESIZE)
+		panic("size is %d, not %d", st.st_size, MAXFILESIZE);
+	cprintf("big file write is good\n");
+
+	for (i = 0; i < ARRAY_SIZE(offsets); i++) {
+		fill(i);
+		seek(fd, offsets[i]);
+		if ((r = readn(fd, got, BLKSIZE)) != BLKSIZE)
+			panic("read at %08x: %e", offsets[i], r);
+		if (memcmp(got, buf, BLKSIZE) != 0)
+			panic("read at %08x got \"%.20s\"", offsets[i], got);
+	}
+	cprintf("big file read is good\n");
+
+	// nothing fits after the last block
+	seek(fd, MAXFILESIZE);
+	if ((r = write(fd, buf, 1)) >= 0)
+		panic("write past MAXFILESIZE succeeded");
+
+	// truncating gives the indirect blocks back, and leaves what's left
+	if ((r = ftruncate(fd, offsets[1] + BLKSIZE)) < 0)
+		panic("ftruncate: %e", r);
+	fill(1);
+	seek(fd, offsets[1]);
+	if ((r = readn(fd, got, BLKSIZE)) != BLKSIZE
+	    || memcmp(got, buf, BLKSIZE) != 0)
+		panic("read after truncate: %e", r);
+	if ((r = ftruncate(fd, 0)) < 0)
+		panic("ftruncate 0: %e", r);
+	close(fd);
+	cprintf("big file truncate is good\n");
+}
@@ -0,0 +1,66 @@
+// test lookups in a large directory, which get a hashed index that is
+// rebuilt bigger as it fills, and the name cache in front of it
+
+#include <inc/lib.h>
+
+#define NFILES	800
+
+static void
+name(char *buf, int i)
+{
+	snprintf(buf, MAXNAMELEN, "/dirtest-%d", i);
+}
+
+void
+umain(int argc, char **argv)
+{
+	char path[MAXNAMELEN];
+	struct Stat st;
+	struct BcStats bs0, bs1;
+	int fd, i, r;
+
+	for (i = 0; i < NFILES; i++) {
+		name(path, i);
+		if ((fd = open(path, O_WRONLY|O_CREAT|O_EXCL)) < 0)
+			panic("create %s: %e", path, fd);
+		if ((r = write(fd, path, strlen(path))) != strlen(path))
+			panic("write %s: %e", path, r);
+		close(fd);
+	}
+	cprintf("directory create is good\n");
+
+	for (i = NFILES - 1; i >= 0; i--) {
+		name(path, i);
+		if ((r = stat(path, &st)) < 0)
+			panic("stat %s: %e", path, r);
+		if (st.st_size != strlen(path) || strcmp(st.st_name, path + 1) != 0)
+			panic("stat %s found %s, size %d", path, st.st_name,
+			      st.st_size);
+	}
+	if ((r = stat("/dirtest-x", &st)) != -E_NOT_FOUND)
+		panic("stat /dirtest-x: %e", r);
+	if ((r = open("/dirtest-0", O_WRONLY|O_CREAT|O_EXCL)) != -E_FILE_EXISTS)
+		panic("second create of /dirtest-0: %e", r);
+	if ((r = stat("/motd", &st)) < 0)
+		panic("stat /motd: %e", r);
+	cprintf("directory lookup is good\n");
+
+	// looking the same names up again hits the name cache
+	if ((r = bcstat(&bs0)) < 0)
+		panic("bcstat: %e", r);
+	for (i = 0; i < 10; i++)
+		if ((r = stat("/motd", &st)) < 0)
+			panic("stat /motd again: %e", r);
+	for (i = 0; i < 10; i++)
+		if ((r = stat("/dirtest-x", &st)) != -E_NOT_FOUND)
+			panic("stat /dirtest-x again: %e", r);
+	if ((r = bcstat(&bs1)) < 0)
+		panic("bcstat: %e", r);
+	// all but the first of each, if the two evict each other
+	if (bs1.dc_hits - bs0.dc_hits < 18)
+		panic("only %d of 20 lookups hit the name cache",
+		      bs1.dc_hits - bs0.dc_hits);
+	cprintf("name cache: %d hits, %d misses overall\n",
+		bs1.dc_hits, bs1.dc_misses);
+	cprintf("name cache is good\n");
+}
@@ -0,0 +1,66 @@
+// test demand-zero memory from sys_page_reserve
+
+#include <inc/lib.h>
+
+#define NPAGES 256
+
+void
+umain(int argc, char **argv)
+{
+	uint8_t *buf = (uint8_t *) UTEMP + PGSIZE;
+	uint32_t *big;
+	int i, r;
+	envid_t who;
+
+	if ((r = sys_page_reserve(0, buf + 1, PGSIZE, PTE_P|PTE_U|PTE_W)) != -E_INVAL)
+		panic("sys_page_reserve unaligned: got %e", r);
+	if ((r = sys_page_reserve(0, buf, NPAGES * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_reserve: %e", r);
+	if (uvpt[PGNUM(buf)] & PTE_P)
+		panic("reserved page is already present");
+
+	for (i = 0; i < NPAGES; i++)
+		if (buf[i * PGSIZE + i] != 0)
+			panic("page %d isn't zero", i);
+	if (!(uvpt[PGNUM(buf)] & PTE_P))
+		panic("touched page is not present");
+	buf[0] = 1;
+
+	// an untouched reservation is inherited by the child, not copied,
+	// and each side's writes to it stay its own
+	if ((r = sys_page_reserve(0, buf + NPAGES * PGSIZE, 2 * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_reserve: %e", r);
+	if ((who = fork()) == 0) {
+		if (buf[0] != 1)
+			panic("child lost the parent's write");
+		// wait until the parent has written its copy
+		ipc_recv(0, 0, 0);
+		for (i = 0; i < 2; i++)
+			if (buf[(NPAGES + i) * PGSIZE + 9] != 0)
+				panic("child's reserved page %d isn't zero", i);
+		for (i = 0; i < 2; i++)
+			buf[(NPAGES + i) * PGSIZE + 9] = 'c';
+		for (i = 0; i < 2; i++)
+			if (buf[(NPAGES + i) * PGSIZE + 9] != 'c')
+				panic("child's write to page %d is lost", i);
+		exit();
+	}
+	buf[NPAGES * PGSIZE + 9] = 'p';
+	ipc_send(who, 0, 0, 0);
+	wait(who);
+	if (buf[NPAGES * PGSIZE + 9] != 'p')
+		panic("parent's reserved page has the child's write");
+	if (buf[(NPAGES + 1) * PGSIZE + 9] != 0)
+		panic("parent sees the child's write to its untouched page");
+
+	// malloc'd memory is demand-zero too
+	big = malloc(NPAGES / 2 * PGSIZE);
+	if (big == 0)
+		panic("malloc failed");
+	for (i = 0; i < NPAGES / 2 * PGSIZE / 4; i += PGSIZE / 4)
+		if (big[i] != 0)
+			panic("malloc'd page isn't zero");
+	free(big);
+
+	cprintf("demand-zero ok\n");
+}
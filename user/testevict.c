@@ -0,0 +1,62 @@
+// test block cache eviction: reading more than the cache holds evicts
+// blocks, but not one a client maps shared, which keeps seeing the
+// file's changes.  Needs a disk bigger than the block cache's 1024
+// blocks, as in 'make FSBLOCKS=4096 run-testevict'.
+
+#include <inc/lib.h>
+
+#define NBLK	1536	// more than the cache holds
+
+char buf[BLKSIZE];
+
+void
+umain(int argc, char **argv)
+{
+	struct BcStats st0, st1;
+	char *shared;
+	int fd, i, r;
+
+	memset(buf, 'a', BLKSIZE);
+	if ((fd = open("/evictmap", O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open /evictmap: %e", fd);
+	if ((r = write(fd, buf, BLKSIZE)) != BLKSIZE)
+		panic("write /evictmap: %e", r);
+	if ((shared = mmap(fd, 0, BLKSIZE, PROT_READ, MAP_SHARED)) == NULL)
+		panic("mmap /evictmap failed");
+	if (shared[0] != 'a')
+		panic("shared mapping doesn't match the file");
+	close(fd);
+
+	if ((fd = open("/evictbig", O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open /evictbig: %e", fd);
+	for (i = 0; i < NBLK; i++) {
+		*(int *) buf = i;
+		if ((r = write(fd, buf, BLKSIZE)) != BLKSIZE)
+			panic("write /evictbig block %d: %e (disk too small?)",
+			      i, r);
+	}
+	if ((r = sync()) < 0 || (r = bcstat(&st0)) < 0)
+		panic("sync/bcstat: %e", r);
+	seek(fd, 0);
+	for (i = 0; i < NBLK; i++)
+		if ((r = readn(fd, buf, BLKSIZE)) != BLKSIZE || *(int *) buf != i)
+			panic("read /evictbig block %d: %e", i, r);
+	close(fd);
+	if ((r = bcstat(&st1)) < 0)
+		panic("bcstat: %e", r);
+	if (st1.bc_evictions == 0)
+		panic("nothing was evicted");
+	cprintf("%d blocks evicted\n", st1.bc_evictions - st0.bc_evictions);
+	cprintf("eviction is good\n");
+
+	// the shared block was kept, so the server's writes reach it
+	if ((fd = open("/evictmap", O_RDWR)) < 0)
+		panic("open /evictmap: %e", fd);
+	if ((r = write(fd, "b", 1)) != 1)
+		panic("write /evictmap: %e", r);
+	close(fd);
+	if (shared[0] != 'b')
+		panic("shared mapping lost the file's changes after eviction");
+	munmap(shared, BLKSIZE);
+	cprintf("shared block survives eviction\n");
+}
@@ -0,0 +1,87 @@
+// test the client-side file cache: small reads and stats are served
+// from it, and changes made by any environment show up in it
+
+#include <inc/lib.h>
+
+#define SIZE	(PGSIZE + 100)
+
+char buf[SIZE + 50];
+
+static void
+fill(char c, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		buf[i] = c + i % 23;
+}
+
+static void
+check(int fd, int size, const char *what)
+{
+	struct Stat st;
+	char c;
+	int i, r;
+
+	for (i = 0; i < 2; i++) {
+		if ((r = fstat(fd, &st)) < 0)
+			panic("fstat %s: %e", what, r);
+		if (st.st_size != size || strcmp(st.st_name, "fcachefile") != 0)
+			panic("fstat %s: %s, size %d, not %d", what, st.st_name,
+			      st.st_size, size);
+	}
+	seek(fd, 0);
+	for (i = 0; i < size; i++)
+		if ((r = read(fd, &c, 1)) != 1 || c != buf[i])
+			panic("read %s at %d: %e, '%c' not '%c'", what, i, r, c,
+			      buf[i]);
+	if ((r = read(fd, &c, 1)) != 0)
+		panic("read %s past the end: %e", what, r);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int fd, r;
+	envid_t child;
+
+	if ((r = fcache_enable()) < 0)
+		panic("fcache_enable: %e", r);
+
+	if ((fd = open("/fcachefile", O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open /fcachefile: %e", fd);
+	fill('a', SIZE);
+	if ((r = write(fd, buf, SIZE)) != SIZE)
+		panic("write: %e", r);
+	check(fd, SIZE, "after write");
+	check(fd, SIZE, "again");
+	cprintf("file cache reads are good\n");
+
+	// our own change
+	fill('A', SIZE);
+	seek(fd, 0);
+	if ((r = write(fd, buf, 10)) != 10)
+		panic("write: %e", r);
+	fill('a', SIZE);
+	fill('A', 10);
+	check(fd, SIZE, "after own write");
+
+	// someone else's
+	if ((child = fork()) < 0)
+		panic("fork: %e", child);
+	if (child == 0) {
+		close(fd);
+		if ((fd = open("/fcachefile", O_WRONLY)) < 0)
+			panic("child open: %e", fd);
+		fill('0', SIZE + 50);
+		if ((r = write(fd, buf, SIZE + 50)) != SIZE + 50)
+			panic("child write: %e", r);
+		close(fd);
+		exit();
+	}
+	wait(child);
+	fill('0', SIZE + 50);
+	check(fd, SIZE + 50, "after other's write");
+	close(fd);
+	cprintf("file cache coherence is good\n");
+}
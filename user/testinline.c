@@ -0,0 +1,107 @@
+// test small files kept inside their File: they read back right, move
+// out to blocks as they grow, and come back in when truncated
+
+#include <inc/lib.h>
+
+#define NFILE	16
+#define BIG	(3 * BLKSIZE + 7)
+
+char buf[BIG], got[BIG];
+
+static void
+check(const char *path, int size, const char *what)
+{
+	struct Stat st;
+	int fd, r;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		panic("open %s %s: %e", path, what, fd);
+	if ((r = fstat(fd, &st)) < 0 || st.st_size != size)
+		panic("fstat %s %s: %e, size %d not %d", path, what, r,
+		      st.st_size, size);
+	memset(got, 0, sizeof(got));
+	if ((r = readn(fd, got, sizeof(got))) != size)
+		panic("read %s %s: %d, not %d", path, what, r, size);
+	if (memcmp(got, buf, size) != 0)
+		panic("read %s %s: wrong data", path, what);
+	close(fd);
+}
+
+void
+umain(int argc, char **argv)
+{
+	char path[16] = "/inline0";
+	struct BcStats st0, st1;
+	uint8_t *map;
+	int fd, i, r;
+
+	for (i = 0; i < BIG; i++)
+		buf[i] = 'a' + i % 26 + i / BLKSIZE;
+
+	// small files only write their directory block
+	if ((r = sync()) < 0 || (r = bcstat(&st0)) < 0)
+		panic("sync/bcstat: %e", r);
+	for (i = 0; i < NFILE; i++) {
+		path[7] = 'a' + i;
+		if ((fd = open(path, O_RDWR|O_CREAT|O_TRUNC)) < 0)
+			panic("open %s: %e", path, fd);
+		if ((r = write(fd, buf, 20 + i)) != 20 + i)
+			panic("write %s: %e", path, r);
+		close(fd);
+	}
+	if ((r = sync()) < 0 || (r = bcstat(&st1)) < 0)
+		panic("sync/bcstat: %e", r);
+	for (i = 0; i < NFILE; i++) {
+		path[7] = 'a' + i;
+		check(path, 20 + i, "small");
+	}
+	cprintf("%d small files: %d blocks written\n", NFILE,
+		st1.bc_written - st0.bc_written);
+	cprintf("small files are good\n");
+
+	// growing a byte at a time, across the end of the File and beyond
+	if ((fd = open("/inlinegrow", O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open /inlinegrow: %e", fd);
+	for (i = 0; i < 2 * MAXINLINESIZE; i++)
+		if ((r = write(fd, buf + i, 1)) != 1)
+			panic("write at %d: %e", i, r);
+	if ((r = write(fd, buf + i, BIG - i)) != BIG - i)
+		panic("write rest: %e", r);
+	close(fd);
+	check("/inlinegrow", BIG, "grown");
+	cprintf("growing out of line is good\n");
+
+	// truncated to nothing, written small again
+	if ((fd = open("/inlinegrow", O_RDWR|O_TRUNC)) < 0)
+		panic("open /inlinegrow O_TRUNC: %e", fd);
+	if ((r = write(fd, buf, 10)) != 10)
+		panic("write after truncate: %e", r);
+	close(fd);
+	check("/inlinegrow", 10, "truncated");
+
+	// shrinking and growing again reads zeroes past the old end
+	if ((fd = open("/inlinegrow", O_RDWR)) < 0)
+		panic("open /inlinegrow: %e", fd);
+	if ((r = ftruncate(fd, 4)) < 0 || (r = ftruncate(fd, 30)) < 0)
+		panic("ftruncate: %e", r);
+	close(fd);
+	memset(buf + 4, 0, 26);
+	check("/inlinegrow", 30, "shrunk and grown");
+	cprintf("truncating back inline is good\n");
+
+	// mapping one maps a copy of its contents
+	if ((fd = open("/inlinegrow", O_RDONLY)) < 0)
+		panic("open /inlinegrow: %e", fd);
+	if ((map = mmap(fd, 0, PGSIZE, PROT_READ, MAP_SHARED)) == NULL)
+		panic("mmap /inlinegrow failed");
+	close(fd);
+	if (memcmp(map, buf, 30) != 0)
+		panic("mapped inline file doesn't match it");
+	for (i = 30; i < PGSIZE; i++)
+		if (map[i] != 0)
+			panic("mapped inline file isn't zero past the end at %d", i);
+	if ((r = munmap(map, PGSIZE)) < 0)
+		panic("munmap: %e", r);
+	check("/inlinegrow", 30, "mapped");
+	cprintf("mapping an inline file is good\n");
+}
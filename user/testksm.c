@@ -0,0 +1,57 @@
+// test same-page merging: identical pages are merged onto one frame,
+// and writing one of them afterwards leaves the others alone.  Needs a
+// kernel built with it on, as in 'make KSM=1 run-testksm'.
+
+#include <inc/lib.h>
+
+#define NPAGE	8
+#define VA	((char *) 0xB0000000)
+
+static bool
+merged(char *va)
+{
+	pte_t pte = uvpt[PGNUM(va)];
+
+	return (pte & PTE_COW) && !(pte & PTE_W);
+}
+
+void
+umain(int argc, char **argv)
+{
+	char *va;
+	int i, r, tries;
+
+	for (i = 0; i < NPAGE; i++) {
+		va = VA + i * PGSIZE;
+		if ((r = sys_page_alloc(0, va, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		memset(va, 'k', PGSIZE);
+		snprintf(va, 16, "same page");
+	}
+
+	// the kernel only scans while a CPU is idle, so sleep until then
+	for (tries = 0; tries < 100; tries++) {
+		for (i = 0; i < NPAGE; i++)
+			if (!merged(VA + i * PGSIZE))
+				break;
+		if (i == NPAGE)
+			break;
+		sys_sleep(50);
+	}
+	if (tries == 100)
+		panic("page %d wasn't merged (kernel built without KSM=1?)", i);
+	cprintf("%d identical pages merged\n", NPAGE);
+
+	// writing one gives it a private copy, the rest still see the old
+	VA[0] = 'x';
+	if (VA[0] != 'x' || !(uvpt[PGNUM(VA)] & PTE_W))
+		panic("write to a merged page didn't take");
+	for (i = 1; i < NPAGE; i++) {
+		va = VA + i * PGSIZE;
+		if (strcmp(va, "same page") != 0 || va[PGSIZE - 1] != 'k')
+			panic("write to page 0 changed page %d", i);
+		if (!merged(va))
+			panic("write to page 0 unmerged page %d", i);
+	}
+	cprintf("writing a merged page is good\n");
+}
@@ -0,0 +1,49 @@
+// test mmap() of a file
+
+#include <inc/lib.h>
+
+#define NBUF (2 * PGSIZE)
+
+uint8_t buf[NBUF + 1];
+
+void
+umain(int argc, char **argv)
+{
+	int fd, r;
+	uint8_t *shared, *private;
+
+	if ((fd = open("/cat", O_RDONLY)) < 0)
+		panic("open /cat: %e", fd);
+	if ((r = readn(fd, buf + 1, NBUF)) != NBUF)
+		panic("readn /cat: got %d, %e", r, r);
+
+	if ((shared = mmap(fd, 0, NBUF, PROT_READ, MAP_SHARED)) == NULL)
+		panic("mmap shared failed");
+	if (mmap(fd, 0, PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED) != NULL)
+		panic("mmap of a writable shared mapping succeeded");
+	if ((private = mmap(fd, PGSIZE, PGSIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE)) == NULL)
+		panic("mmap private failed");
+	// the mappings outlive the descriptor
+	close(fd);
+
+	if (uvpt[PGNUM(shared)] & PTE_P)
+		panic("mmap fetched a page before it was touched");
+	if (memcmp(shared, buf + 1, NBUF) != 0)
+		panic("shared mapping doesn't match the file");
+	if (memcmp(private, buf + 1 + PGSIZE, PGSIZE) != 0)
+		panic("private mapping doesn't match the file");
+	cprintf("mmap read is good\n");
+
+	memset(private, 0, PGSIZE);
+	if (memcmp(shared + PGSIZE, buf + 1 + PGSIZE, PGSIZE) != 0)
+		panic("write to private mapping reached the file");
+	cprintf("mmap private write is good\n");
+
+	if ((r = munmap(shared, NBUF)) < 0)
+		panic("munmap: %e", r);
+	if ((r = munmap(private, PGSIZE)) < 0)
+		panic("munmap: %e", r);
+	if (uvpt[PGNUM(shared)] & PTE_P)
+		panic("munmap left a page mapped");
+	cprintf("munmap is good\n");
+}
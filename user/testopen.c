@@ -0,0 +1,48 @@
+// test that the file server's open files are reused: closed ones at
+// once, and those of environments killed while holding them once the
+// rest run out
+
+#include <inc/lib.h>
+
+#define NOPEN	1100	// more than the file server's 1024 open files
+#define NCHILD	37	// children killed holding 30 files each
+#define NHELD	30
+
+static void
+churn(const char *what)
+{
+	int fd, i;
+	uint32_t t0;
+
+	t0 = sys_time_msec();
+	for (i = 0; i < NOPEN; i++) {
+		if ((fd = open("/motd", O_RDONLY)) < 0)
+			panic("%s: open %d: %e", what, i, fd);
+		close(fd);
+	}
+	cprintf("%s: %d opens in %d msec\n", what, NOPEN, sys_time_msec() - t0);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t child;
+	int fd, i, j;
+
+	churn("open and close");
+
+	for (i = 0; i < NCHILD; i++) {
+		if ((child = fork()) < 0)
+			panic("fork: %e", child);
+		if (child == 0) {
+			for (j = 0; j < NHELD; j++)
+				if ((fd = open("/motd", O_RDONLY)) < 0)
+					panic("child open %d: %e", j, fd);
+			// no exit(), which would close them
+			sys_env_destroy(0);
+		}
+		wait(child);
+	}
+	churn("after killed children");
+	cprintf("open file reuse is good\n");
+}
@@ -0,0 +1,63 @@
+// test reads and writes of many pages at once, which move up to
+// FSIPC_MAXPAGES pages per request to the file server
+
+#include <inc/lib.h>
+
+#define NBYTES	(40 * PGSIZE + 100)
+
+char buf[NBYTES];
+// one byte off a page boundary, so that reads into it are not mapped
+// from the block cache a page at a time instead (see testreadmap)
+char gotbuf[NBYTES + 1] __attribute__((aligned(PGSIZE)));
+#define got	(gotbuf + 1)
+
+void
+umain(int argc, char **argv)
+{
+	int fd, i, r, n;
+
+	for (i = 0; i < NBYTES; i++)
+		buf[i] = i * 7 + i / PGSIZE;
+
+	if ((fd = open("/pagesfile", O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open /pagesfile: %e", fd);
+	// one request takes as much as it can carry
+	if ((r = write(fd, buf, NBYTES)) != FSIPC_MAXPAGES * PGSIZE)
+		panic("first write wrote %d, not %d", r, FSIPC_MAXPAGES * PGSIZE);
+	for (n = r; n < NBYTES; n += r)
+		if ((r = write(fd, buf + n, NBYTES - n)) <= 0)
+			panic("write at %d: %e", n, r);
+	cprintf("many-page write is good\n");
+
+	seek(fd, 0);
+	if ((r = read(fd, got, NBYTES)) != FSIPC_MAXPAGES * PGSIZE)
+		panic("first read read %d, not %d", r, FSIPC_MAXPAGES * PGSIZE);
+	if ((r = readn(fd, got + r, NBYTES - r)) != NBYTES - FSIPC_MAXPAGES * PGSIZE)
+		panic("rest of read: %e", r);
+	if (memcmp(got, buf, NBYTES) != 0)
+		panic("read back the wrong data");
+
+	// not page aligned, in the file or in memory
+	memset(got, 0, NBYTES);
+	seek(fd, 123);
+	if ((r = readn(fd, got + 5, 3 * PGSIZE)) != 3 * PGSIZE
+	    || memcmp(got + 5, buf + 123, 3 * PGSIZE) != 0)
+		panic("unaligned read: %e", r);
+	// and short at the end of the file
+	seek(fd, NBYTES - 1000);
+	if ((r = read(fd, got, 2 * PGSIZE)) != 1000
+	    || memcmp(got, buf + NBYTES - 1000, 1000) != 0)
+		panic("read at end of file: %d", r);
+	cprintf("many-page read is good\n");
+
+	// a little less than a page still fits in the request page
+	seek(fd, 0);
+	if ((r = write(fd, buf + 1, PGSIZE - 2)) != PGSIZE - 2)
+		panic("write of a page less 2: %e", r);
+	seek(fd, 0);
+	if ((r = readn(fd, got, PGSIZE - 2)) != PGSIZE - 2
+	    || memcmp(got, buf + 1, PGSIZE - 2) != 0)
+		panic("read of a page less 2: %e", r);
+	close(fd);
+	cprintf("page-sized write is good\n");
+}
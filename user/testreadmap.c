@@ -0,0 +1,51 @@
+// test page-aligned reads that map the file server's block cache
+
+#include <inc/lib.h>
+
+#define NBUF (2 * PGSIZE)
+
+uint8_t mapbuf[NBUF] __attribute__((aligned(PGSIZE)));
+uint8_t copybuf[NBUF + 1];
+
+void
+umain(int argc, char **argv)
+{
+	int fd, r;
+
+	// an unaligned buffer takes the copying path
+	if ((fd = open("/cat", O_RDONLY)) < 0)
+		panic("open /cat: %e", fd);
+	if ((r = readn(fd, copybuf + 1, NBUF)) != NBUF)
+		panic("readn /cat: got %d, %e", r, r);
+	close(fd);
+
+	if ((fd = open("/cat", O_RDONLY)) < 0)
+		panic("open /cat: %e", fd);
+	if ((r = readn(fd, mapbuf, NBUF)) != NBUF)
+		panic("readn /cat: got %d, %e", r, r);
+	if (!(uvpt[PGNUM(mapbuf)] & PTE_COW))
+		panic("aligned read was copied, not mapped");
+	if (memcmp(mapbuf, copybuf + 1, NBUF) != 0)
+		panic("mapped read doesn't match copied read");
+	cprintf("mapped read is good\n");
+
+	// writing our copy must not change the file
+	memset(mapbuf, 0, NBUF);
+	seek(fd, 0);
+	if ((r = readn(fd, copybuf, NBUF)) != NBUF)
+		panic("readn /cat: got %d, %e", r, r);
+	if (memcmp(copybuf, mapbuf, PGSIZE) == 0)
+		panic("write to mapped read reached the file");
+	cprintf("copy-on-write of mapped read is good\n");
+
+	// a whole page at an unaligned offset falls back to a copy, even
+	// into an aligned buffer
+	memset(mapbuf, 0, PGSIZE);
+	seek(fd, 100);
+	if ((r = read(fd, mapbuf, PGSIZE)) != PGSIZE)
+		panic("read /cat at 100: got %d, %e", r, r);
+	if (memcmp(mapbuf, copybuf + 100, PGSIZE) != 0)
+		panic("unaligned page read returned the wrong data");
+	close(fd);
+	cprintf("unaligned page read is good\n");
+}
@@ -0,0 +1,56 @@
+// test a tmpfs: files under the mount point live in RAM and are never
+// written to the disk
+
+#include <inc/lib.h>
+
+#define NBLK	64
+
+char buf[BLKSIZE], got[BLKSIZE];
+
+void
+umain(int argc, char **argv)
+{
+	struct BcStats bs0, bs1;
+	struct Stat st;
+	int fd, i, r;
+
+	if ((r = mount_tmpfs("/tmp")) < 0)
+		panic("mount_tmpfs: %e", r);
+	if ((r = mount_tmpfs("/tmp")) != -E_INVAL)
+		panic("second mount_tmpfs: %e", r);
+	if ((r = stat("/tmp", &st)) < 0)
+		panic("stat /tmp: %e", r);
+	if (!st.st_isdir || st.st_size != 0)
+		panic("/tmp is not an empty directory");
+	cprintf("tmpfs mount is good\n");
+
+	if ((r = sync()) < 0 || (r = bcstat(&bs0)) < 0)
+		panic("sync/bcstat: %e", r);
+	if ((fd = open("/tmp/scratch", O_RDWR|O_CREAT|O_EXCL)) < 0)
+		panic("open /tmp/scratch: %e", fd);
+	for (i = 0; i < NBLK; i++) {
+		memset(buf, 'a' + i % 26, BLKSIZE);
+		if ((r = write(fd, buf, BLKSIZE)) != BLKSIZE)
+			panic("write: %e", r);
+	}
+	if ((r = sync()) < 0 || (r = bcstat(&bs1)) < 0)
+		panic("sync/bcstat: %e", r);
+	if (bs1.bc_writes != bs0.bc_writes || bs1.jn_logged != bs0.jn_logged)
+		panic("writing to /tmp wrote %d blocks and logged %d",
+		      bs1.bc_written - bs0.bc_written,
+		      bs1.jn_logged - bs0.jn_logged);
+	cprintf("tmpfs write is good\n");
+
+	seek(fd, 0);
+	for (i = 0; i < NBLK; i++) {
+		memset(buf, 'a' + i % 26, BLKSIZE);
+		if ((r = readn(fd, got, BLKSIZE)) != BLKSIZE)
+			panic("read: %e", r);
+		if (memcmp(got, buf, BLKSIZE) != 0)
+			panic("block %d read back wrong", i);
+	}
+	close(fd);
+	if ((r = stat("/tmp/scratch", &st)) < 0 || st.st_size != NBLK * BLKSIZE)
+		panic("stat /tmp/scratch: %e, size %d", r, st.st_size);
+	cprintf("tmpfs read is good\n");
+}
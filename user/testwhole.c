@@ -0,0 +1,55 @@
+// test read_whole_file, which reads a file with compound requests that
+// open, stat, read and close it all at once
+
+#include <inc/lib.h>
+
+#define BIG	(40 * PGSIZE + 10)	// more than one request carries
+
+char buf[BIG], got[BIG + PGSIZE];
+
+static void
+check(const char *path, size_t size, size_t max)
+{
+	int r;
+
+	memset(got, 0, sizeof(got));
+	if ((r = read_whole_file(path, got, max)) != size)
+		panic("read_whole_file %s, max %d: %e", path, max, r);
+	if (memcmp(got, buf, MIN(size, max)) != 0)
+		panic("read_whole_file %s, max %d: wrong data", path, max);
+	if (max < size && got[max] != 0)
+		panic("read_whole_file %s, max %d: read too much", path, max);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int fd, i, r;
+
+	if ((fd = open("/motd", O_RDONLY)) < 0)
+		panic("open /motd: %e", fd);
+	if ((r = readn(fd, buf, BIG)) <= 0)
+		panic("readn /motd: %e", r);
+	close(fd);
+	check("/motd", r, sizeof(got));
+	check("/motd", r, 10);
+	cprintf("small whole file is good\n");
+
+	for (i = 0; i < BIG; i++)
+		buf[i] = i * 3 + i / PGSIZE;
+	if ((fd = open("/wholefile", O_RDWR|O_CREAT|O_TRUNC)) < 0)
+		panic("open /wholefile: %e", fd);
+	for (i = 0; i < BIG; i += r)
+		if ((r = write(fd, buf + i, BIG - i)) <= 0)
+			panic("write /wholefile: %e", r);
+	close(fd);
+	check("/wholefile", BIG, sizeof(got));
+	check("/wholefile", BIG, 3 * PGSIZE + 1);
+	cprintf("big whole file is good\n");
+
+	if ((r = read_whole_file("/", got, sizeof(got))) != -E_INVAL)
+		panic("read_whole_file of a directory: %e", r);
+	if ((r = read_whole_file("/no-such-file", got, sizeof(got))) != -E_NOT_FOUND)
+		panic("read_whole_file of a missing file: %e", r);
+	cprintf("whole file errors are good\n");
+}